@@ -19,13 +19,43 @@
 #define ARP_OP_REQUEST 0x0001
 #define ARP_OP_REPLY   0x0002
 
-#define ARP_CACHE_SIZE 32
-#define ARP_CACHE_TIMEOUT 30 /* seconds */
+#define ARP_CACHE_SIZE 256 /* default capacity */
+#define ARP_CACHE_SIZE_MAX 65536
+#define ARP_CACHE_TIMEOUT 30 /* seconds, for INCOMPLETE */
+#define ARP_REACHABLE_TIME 30 /* seconds since the last confirmation */
+#define ARP_STALE_TIME 60 /* seconds, STALE entries not used are deleted */
+#define ARP_DELAY_TIME 5 /* seconds, waiting for a confirmation before probing */
+#define ARP_PROBE_MAX 3 /* unicast requests (one per second) before giving up */
+#define ARP_RETRANS_TIME 1000 /* msec, the first interval of the broadcast requests, doubled each time */
+#define ARP_REQUEST_MAX 5 /* broadcast requests for an INCOMPLETE entry (sent at 0, 1, 3, 7 and 15 seconds) */
+#define ARP_RATE_LIMIT 100 /* requests per second (for all entries), 0: unlimited */
+#define ARP_RATE_BURST 20
+#define ARP_RATE_MAX 65535 /* for both of the rate and the burst */
+#define ARP_PENDING_MAX 8 /* packets held by an unresolved entry */
 
+/*
+ * Neighbor Unreachability Detection (like RFC 4861, section 7.3)
+ *
+ *   INCOMPLETE -> REACHABLE : reply received
+ *   INCOMPLETE -> FREE      : no reply within ARP_CACHE_TIMEOUT (ARP_REQUEST_MAX requests with backoff)
+ *   REACHABLE  -> STALE     : ARP_REACHABLE_TIME passed without a confirmation
+ *   STALE      -> DELAY     : used for sending
+ *   DELAY      -> PROBE     : ARP_DELAY_TIME passed without a confirmation
+ *   PROBE      -> FREE      : no reply to ARP_PROBE_MAX unicast requests
+ *   any        -> REACHABLE : reply received, or confirmed by the upper layer (arp_confirm)
+ *
+ * The entries other than FREE and INCOMPLETE are usable for sending. STATIC entries
+ * (arp_add_static) never change, the entries loaded from a snapshot start as STALE.
+ */
 #define ARP_CACHE_STATE_FREE       0
 #define ARP_CACHE_STATE_INCOMPLETE 1
-#define ARP_CACHE_STATE_RESOLVED   2
-#define ARP_CACHE_STATE_STATIC     3
+#define ARP_CACHE_STATE_REACHABLE  2
+#define ARP_CACHE_STATE_STALE      3
+#define ARP_CACHE_STATE_DELAY      4
+#define ARP_CACHE_STATE_PROBE      5
+#define ARP_CACHE_STATE_STATIC     6
+
+#define ARP_CACHE_STATE_IS_VALID(x) ((x) != ARP_CACHE_STATE_FREE && (x) != ARP_CACHE_STATE_INCOMPLETE)
 
 struct arp_hdr {
     uint16_t hrd;
@@ -43,15 +73,59 @@ struct arp_ether {
     uint8_t tpa[IP_ADDR_LEN];
 };
 
+/* NOTE: a packet waiting for the resolution of its next hop */
+struct arp_pending {
+    struct net_device *dev;
+    uint16_t type;
+    int (*output)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+    size_t len;
+    uint8_t data[];
+};
+
 struct arp_cache {
+    uint32_t seq; /* odd while being written (for the lock-free readers) */
+    uint32_t gen; /* changed when the address handed out may be outdated (see arp_handle_is_valid) */
     unsigned char state;
     ip_addr_t pa;
     uint8_t ha[ETHER_ADDR_LEN];
     struct timeval timestamp;
+    uint8_t referenced; /* set by the lock-free readers, second chance on eviction */
+    uint8_t used; /* set by the lock-free readers, STALE to DELAY */
+    uint8_t confirmed; /* set by arp_confirm() */
+    uint8_t probes; /* broadcast requests while INCOMPLETE, unicast requests while PROBE */
+    struct timeval retrans; /* the next broadcast request is allowed at */
+    struct net_iface *iface; /* to send the probes */
+    struct queue_head pending; /* while INCOMPLETE, flushed in order when resolved */
+    struct arp_cache *prev; /* LRU list (or free list) */
+    struct arp_cache *next;
 };
 
+/*
+ * ARP Cache: open addressing (linear probing) hash table keyed by the protocol address
+ *
+ *   slots[] : index + 1 of caches[] (0: empty), at least twice as many as the entries
+ *   lru     : list of the entries in use, the most recently used first
+ *
+ * The writers are serialized by the mutex. arp_resolve() looks up the table without it,
+ * a miss (including a false one while an entry is moving) falls back to the locked path.
+ */
+#define ARP_HANDLE(idx, gen) (((uint64_t)(idx) << 32) | (gen))
+
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct arp_cache caches[ARP_CACHE_SIZE];
+static struct arp_cache *caches;
+static size_t capacity;
+static uint32_t *slots;
+static uint32_t mask; /* number of slots - 1 */
+static struct arp_cache lru = {.prev = &lru, .next = &lru};
+static struct arp_cache *frees;
+
+/* NOTE: token bucket shared by all of the outgoing requests (protected by the mutex) */
+static struct {
+    unsigned int rate; /* tokens per second */
+    unsigned int burst;
+    uint64_t credit; /* usec * rate, a token costs 1000000 */
+    struct timeval last;
+} ratelimit = {.rate = ARP_RATE_LIMIT, .burst = ARP_RATE_BURST, .credit = (uint64_t)ARP_RATE_BURST * 1000000};
 
 static char *
 arp_opcode_ntoa(uint16_t opcode)
@@ -97,37 +171,153 @@ arp_dump(const uint8_t *data, size_t len)
  * NOTE: ARP Cache functions must be called after mutex locked
  */
 
+/* NOTE: the addresses are in network byte order, mix the varying host part into the lower bits */
+static uint32_t
+arp_cache_hash(ip_addr_t pa)
+{
+    uint32_t hash;
+
+    hash = pa;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash & mask;
+}
+
+static void
+arp_cache_write_begin(struct arp_cache *cache)
+{
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+arp_cache_write_end(struct arp_cache *cache)
+{
+    __atomic_store_n(&cache->seq, cache->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+arp_cache_lru_unlink(struct arp_cache *cache)
+{
+    cache->prev->next = cache->next;
+    cache->next->prev = cache->prev;
+}
+
+static void
+arp_cache_lru_push(struct arp_cache *cache)
+{
+    cache->prev = &lru;
+    cache->next = lru.next;
+    lru.next->prev = cache;
+    lru.next = cache;
+}
+
+static void
+arp_cache_touch(struct arp_cache *cache)
+{
+    arp_cache_lru_unlink(cache);
+    arp_cache_lru_push(cache);
+    cache->referenced = 0;
+}
+
 static struct arp_cache *
-arp_cache_alloc(void)
+arp_cache_select(ip_addr_t pa)
 {
-    struct arp_cache *entry, *oldest = NULL;
+    struct arp_cache *entry;
+    uint32_t i;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state == ARP_CACHE_STATE_FREE) {
+    for (i = arp_cache_hash(pa); slots[i]; i = (i + 1) & mask) {
+        entry = &caches[slots[i]-1];
+        if (entry->pa == pa) {
             return entry;
         }
-        if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >)) {
-            oldest = entry;
+    }
+    return NULL;
+}
+
+static void
+arp_cache_link(struct arp_cache *cache)
+{
+    uint32_t i;
+
+    for (i = arp_cache_hash(cache->pa); slots[i]; i = (i + 1) & mask);
+    /* NOTE: the entry has been filled, publish it to the readers */
+    __atomic_store_n(&slots[i], cache - caches + 1, __ATOMIC_RELEASE);
+    arp_cache_lru_push(cache);
+}
+
+/* NOTE: backward shift deletion, keep the probe sequences without tombstones */
+static void
+arp_cache_unlink(struct arp_cache *cache)
+{
+    uint32_t i, j, k;
+
+    for (i = arp_cache_hash(cache->pa); &caches[slots[i]-1] != cache; i = (i + 1) & mask);
+    __atomic_store_n(&slots[i], 0, __ATOMIC_RELEASE);
+    for (j = (i + 1) & mask; slots[j]; j = (j + 1) & mask) {
+        k = arp_cache_hash(caches[slots[j]-1].pa);
+        /* move it unless its home slot lies cyclically in (i, j] */
+        if ((i < j) ? (k <= i || k > j) : (k <= i && k > j)) {
+            __atomic_store_n(&slots[i], slots[j], __ATOMIC_RELEASE);
+            __atomic_store_n(&slots[j], 0, __ATOMIC_RELEASE);
+            i = j;
         }
     }
-    return oldest;
+    arp_cache_lru_unlink(cache);
 }
 
+static void
+arp_cache_delete(struct arp_cache *cache)
+{
+    struct arp_pending *pending;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[ETHER_ADDR_STR_LEN];
+
+    debugf("DELETE: pa=%s, ha=%s, pending=%u",
+        ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)), cache->pending.num);
+    arp_cache_unlink(cache);
+    while ((pending = queue_pop(&cache->pending))) {
+        memory_free(pending);
+    }
+    arp_cache_write_begin(cache);
+    if (ARP_CACHE_STATE_IS_VALID(cache->state)) {
+        cache->gen++;
+    }
+    cache->state = ARP_CACHE_STATE_FREE;
+    cache->pa = 0;
+    memset(cache->ha, 0, ETHER_ADDR_LEN);
+    arp_cache_write_end(cache);
+    timerclear(&cache->timestamp);
+    cache->next = frees;
+    frees = cache;
+}
+
+/* NOTE: evict the least recently used entry when full (an entry used by the readers gets a second chance) */
 static struct arp_cache *
-arp_cache_select(ip_addr_t pa)
+arp_cache_alloc(void)
 {
     struct arp_cache *entry;
+    size_t n;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->pa == pa) {
-            return entry;
+    for (n = 0; !frees && n < capacity * 2; n++) {
+        entry = lru.prev;
+        if (entry->state == ARP_CACHE_STATE_STATIC || __atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED)) {
+            arp_cache_touch(entry);
+            continue;
         }
+        arp_cache_delete(entry);
     }
-    return NULL;
+    entry = frees;
+    if (entry) {
+        frees = entry->next;
+    }
+    return entry;
 }
 
+/* NOTE: the pending packets are handed over to be sent after unlocking the mutex */
 static struct arp_cache *
-arp_cache_update(ip_addr_t pa, const uint8_t *ha)
+arp_cache_update(ip_addr_t pa, const uint8_t *ha, struct queue_head *pending)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
@@ -138,15 +328,29 @@ arp_cache_update(ip_addr_t pa, const uint8_t *ha)
         /* not found */
         return NULL;
     }
-    cache->state = ARP_CACHE_STATE_RESOLVED;
+    if (cache->state == ARP_CACHE_STATE_STATIC) {
+        /* NOTE: never overwritten by the packets */
+        return cache;
+    }
+    arp_cache_write_begin(cache);
+    if (ARP_CACHE_STATE_IS_VALID(cache->state) && memcmp(cache->ha, ha, ETHER_ADDR_LEN) != 0) {
+        cache->gen++;
+    }
+    cache->state = ARP_CACHE_STATE_REACHABLE;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    arp_cache_write_end(cache);
     gettimeofday(&cache->timestamp, NULL);
-    debugf("UPDATE: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+    cache->probes = 0;
+    arp_cache_touch(cache);
+    *pending = cache->pending;
+    queue_init(&cache->pending);
+    debugf("UPDATE: pa=%s, ha=%s, pending=%u",
+        ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)), pending->num);
     return cache;
 }
 
 static struct arp_cache *
-arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
+arp_cache_insert(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha, unsigned char state)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
@@ -157,32 +361,145 @@ arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
         errorf("arp_cache_alloc() failure");
         return NULL;
     }
-    cache->state = ARP_CACHE_STATE_RESOLVED;
+    arp_cache_write_begin(cache);
+    cache->state = state;
     cache->pa = pa;
-    memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    if (ha) {
+        memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    }
+    arp_cache_write_end(cache);
     gettimeofday(&cache->timestamp, NULL);
-    debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+    cache->referenced = 0;
+    cache->used = 0;
+    cache->confirmed = 0;
+    cache->probes = 0;
+    timerclear(&cache->retrans);
+    cache->iface = iface;
+    arp_cache_link(cache);
+    debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
     return cache;
 }
 
-static void
-arp_cache_delete(struct arp_cache *cache)
+/* NOTE: lock-free, returns 0 when not found (or raced with a writer) */
+static int
+arp_cache_lookup(ip_addr_t pa, uint8_t *ha, uint64_t *handle)
 {
-    char addr1[IP_ADDR_STR_LEN];
-    char addr2[ETHER_ADDR_STR_LEN];
+    struct arp_cache *entry;
+    uint32_t i, idx, seq, gen;
+    unsigned char state;
 
-    debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
-    cache->state = ARP_CACHE_STATE_FREE;
-    cache->pa = 0;
-    memset(cache->ha, 0, ETHER_ADDR_LEN);
-    timerclear(&cache->timestamp);
+    if (!slots) {
+        return 0;
+    }
+    for (i = arp_cache_hash(pa); (idx = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE)); i = (i + 1) & mask) {
+        entry = &caches[idx-1];
+        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            return 0;
+        }
+        if (__atomic_load_n(&entry->pa, __ATOMIC_RELAXED) != pa) {
+            continue;
+        }
+        state = __atomic_load_n(&entry->state, __ATOMIC_RELAXED);
+        gen = __atomic_load_n(&entry->gen, __ATOMIC_RELAXED);
+        memcpy(ha, entry->ha, ETHER_ADDR_LEN);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+            return 0;
+        }
+        if (!ARP_CACHE_STATE_IS_VALID(state)) {
+            return 0;
+        }
+        if (!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        }
+        if (!__atomic_load_n(&entry->used, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->used, 1, __ATOMIC_RELAXED);
+        }
+        if (handle) {
+            *handle = ARP_HANDLE(idx, gen);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* NOTE: the entries are dropped (must be called without any entry in use) */
+static int
+arp_cache_setup(size_t size)
+{
+    struct arp_cache *new_caches;
+    uint32_t *new_slots;
+    size_t n = 1, i;
+
+    while (n < size * 2) {
+        n <<= 1;
+    }
+    new_caches = memory_alloc(sizeof(*new_caches) * size);
+    if (!new_caches) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    new_slots = memory_alloc(sizeof(*new_slots) * n);
+    if (!new_slots) {
+        errorf("memory_alloc() failure");
+        memory_free(new_caches);
+        return -1;
+    }
+    if (caches) {
+        memory_free(caches);
+        memory_free(slots);
+    }
+    caches = new_caches;
+    capacity = size;
+    slots = new_slots;
+    mask = n - 1;
+    lru.prev = lru.next = &lru;
+    frees = NULL;
+    for (i = size; i > 0; i--) {
+        queue_init(&caches[i-1].pending);
+        caches[i-1].next = frees;
+        frees = &caches[i-1];
+    }
+    return 0;
+}
+
+static int
+arp_ratelimit(void)
+{
+    struct timeval now, diff;
+    uint64_t elapsed, limit;
+
+    if (!ratelimit.rate) {
+        return 0;
+    }
+    gettimeofday(&now, NULL);
+    timersub(&now, &ratelimit.last, &diff);
+    ratelimit.last = now;
+    limit = (uint64_t)ratelimit.burst * 1000000;
+    if (diff.tv_sec >= 0) {
+        /* NOTE: a full bucket after an idle period of burst seconds, no overflow */
+        elapsed = MIN((uint64_t)diff.tv_sec * 1000000 + diff.tv_usec, limit);
+        ratelimit.credit = MIN(ratelimit.credit + elapsed * ratelimit.rate, limit);
+    }
+    if (ratelimit.credit < 1000000) {
+        return -1;
+    }
+    ratelimit.credit -= 1000000;
+    return 0;
 }
 
+/* NOTE: dst is NULL for a broadcast, the address of the entry for a unicast probe */
 static int
-arp_request(struct net_iface *iface, ip_addr_t tpa)
+arp_request(struct net_iface *iface, ip_addr_t tpa, const uint8_t *dst)
 {
     struct arp_ether request;
+    char addr[IP_ADDR_STR_LEN];
 
+    if (arp_ratelimit() == -1) {
+        debugf("rate limited, tpa=%s", ip_addr_ntop(tpa, addr, sizeof(addr)));
+        return -1;
+    }
     request.hdr.hrd = hton16(ARP_HRD_ETHER);
     request.hdr.pro = hton16(ARP_PRO_IP);
     request.hdr.hln = ETHER_ADDR_LEN;
@@ -194,7 +511,7 @@ arp_request(struct net_iface *iface, ip_addr_t tpa)
     memcpy(request.tpa, &tpa, IP_ADDR_LEN);
     debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
     arp_dump((uint8_t *)&request, sizeof(request));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), dst ? dst : iface->dev->broadcast);
 }
 
 static int
@@ -216,13 +533,54 @@ arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint
     return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
 }
 
+/*
+ * Broadcast a request for an INCOMPLETE entry unless one has been sent recently,
+ * the interval is doubled each time and ARP_REQUEST_MAX requests at most
+ */
 static void
-arp_input(const uint8_t *data, size_t len, struct net_device *dev)
+arp_solicit(struct arp_cache *cache, const struct timeval *now)
+{
+    uint32_t msec;
+
+    if (cache->probes >= ARP_REQUEST_MAX || timercmp(now, &cache->retrans, <)) {
+        return;
+    }
+    if (arp_request(cache->iface, cache->pa, NULL) == -1) {
+        /* NOTE: retried by the next call (not counted) */
+        return;
+    }
+    msec = ARP_RETRANS_TIME << cache->probes;
+    cache->probes++;
+    cache->retrans.tv_sec = now->tv_sec + msec / 1000;
+    cache->retrans.tv_usec = now->tv_usec + (msec % 1000) * 1000;
+    if (cache->retrans.tv_usec >= 1000000) {
+        cache->retrans.tv_sec++;
+        cache->retrans.tv_usec -= 1000000;
+    }
+}
+
+static void
+arp_pending_flush(struct queue_head *queue, const uint8_t *ha)
+{
+    struct arp_pending *pending;
+
+    while ((pending = queue_pop(queue))) {
+        debugf("dev=%s, type=0x%04x, len=%zu", pending->dev->name, pending->type, pending->len);
+        if (pending->output(pending->dev, pending->type, pending->data, pending->len, ha) == -1) {
+            errorf("output failure, dev=%s", pending->dev->name);
+        }
+        memory_free(pending);
+    }
+}
+
+static void
+arp_input(const uint8_t *data, size_t len, struct net_device *dev, int flags)
 {
     struct arp_ether *msg;
     ip_addr_t spa, tpa;
     int merge = 0;
     struct net_iface *iface;
+    struct queue_head pending = {};
 
     if (len < sizeof(*msg)) {
         errorf("too short");
@@ -242,16 +600,17 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     memcpy(&spa, msg->spa, sizeof(spa));
     memcpy(&tpa, msg->tpa, sizeof(tpa));
     mutex_lock(&mutex);
-    if (arp_cache_update(spa, msg->sha)) {
+    if (arp_cache_update(spa, msg->sha, &pending)) {
         /* updated */
         merge = 1;
     }
     mutex_unlock(&mutex);
+    arp_pending_flush(&pending, msg->sha);
     iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
     if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
         if (!merge) {
             mutex_lock(&mutex);
-            arp_cache_insert(spa, msg->sha);
+            arp_cache_insert(iface, spa, msg->sha, ARP_CACHE_STATE_REACHABLE);
             mutex_unlock(&mutex);
         }
         if (ntoh16(msg->hdr.op) == ARP_OP_REQUEST) {
@@ -260,10 +619,12 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     }
 }
 
+/* NOTE: the handle (NULL: not needed) tells later whether the address is still valid */
 int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+arp_resolve_handle(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, uint64_t *handle)
 {
     struct arp_cache *cache;
+    struct timeval now;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
@@ -275,35 +636,161 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
         debugf("unsupported protocol address type");
         return ARP_RESOLVE_ERROR;
     }
+    if (arp_cache_lookup(pa, ha, handle)) {
+        debugf("resolved, pa=%s, ha=%s",
+            ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+        return ARP_RESOLVE_FOUND;
+    }
     mutex_lock(&mutex);
+    gettimeofday(&now, NULL);
     cache = arp_cache_select(pa);
     if (!cache) {
-        cache = arp_cache_alloc();
+        cache = arp_cache_insert(iface, pa, NULL, ARP_CACHE_STATE_INCOMPLETE);
         if (!cache) {
             mutex_unlock(&mutex);
-            errorf("arp_cache_alloc() failure");
+            errorf("arp_cache_insert() failure");
             return ARP_RESOLVE_ERROR;
         }
-        cache->state = ARP_CACHE_STATE_INCOMPLETE;
-        cache->pa = pa;
-        gettimeofday(&cache->timestamp, NULL);
-        arp_request(iface, pa);
+        arp_solicit(cache, &now);
         mutex_unlock(&mutex);
         debugf("cache not found, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
         return ARP_RESOLVE_INCOMPLETE;
     }
     if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
-        arp_request(iface, pa); /* just in case packet loss */
+        /* NOTE: the retransmission is paced, not for every packet */
+        arp_solicit(cache, &now);
         mutex_unlock(&mutex);
         return ARP_RESOLVE_INCOMPLETE;
     }
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
+    if (handle) {
+        *handle = ARP_HANDLE(cache - caches + 1, cache->gen);
+    }
+    cache->used = 1;
+    arp_cache_touch(cache);
     mutex_unlock(&mutex);
     debugf("resolved, pa=%s, ha=%s",
         ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return ARP_RESOLVE_FOUND;
 }
 
+/*
+ * Hold a packet for an unresolved address (after ARP_RESOLVE_INCOMPLETE), it is sent
+ * when the reply arrives or dropped with the entry on timeout
+ */
+/* NOTE: output sends the packet when resolved (NULL: net_device_output), e.g. cuts it by GSO */
+int
+arp_enqueue(struct net_iface *iface, ip_addr_t pa, uint16_t type, const struct iovec *iov, int iovcnt,
+    int (*output)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst))
+{
+    struct arp_cache *cache;
+    struct arp_pending *pending;
+    uint8_t ha[ETHER_ADDR_LEN];
+    size_t len;
+    char addr[IP_ADDR_STR_LEN];
+
+    len = iovec_len(iov, iovcnt);
+    pending = memory_alloc(sizeof(*pending) + len);
+    if (!pending) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    pending->dev = iface->dev;
+    pending->type = type;
+    pending->output = output ? output : net_device_output;
+    pending->len = iovec_gather(pending->data, len, iov, iovcnt);
+    mutex_lock(&mutex);
+    cache = arp_cache_select(pa);
+    if (!cache || cache->state == ARP_CACHE_STATE_FREE) {
+        mutex_unlock(&mutex);
+        memory_free(pending);
+        debugf("no entry, pa=%s", ip_addr_ntop(pa, addr, sizeof(addr)));
+        return -1;
+    }
+    if (cache->state != ARP_CACHE_STATE_INCOMPLETE) {
+        /* NOTE: the reply has arrived since arp_resolve() */
+        memcpy(ha, cache->ha, ETHER_ADDR_LEN);
+        mutex_unlock(&mutex);
+        if (pending->output(pending->dev, pending->type, pending->data, pending->len, ha) == -1) {
+            errorf("output failure, dev=%s", pending->dev->name);
+            memory_free(pending);
+            return -1;
+        }
+        memory_free(pending);
+        return 0;
+    }
+    if (cache->pending.num >= ARP_PENDING_MAX || !queue_push(&cache->pending, pending)) {
+        mutex_unlock(&mutex);
+        memory_free(pending);
+        debugf("queue is full, pa=%s", ip_addr_ntop(pa, addr, sizeof(addr)));
+        return -1;
+    }
+    mutex_unlock(&mutex);
+    debugf("queued, pa=%s, len=%zu", ip_addr_ntop(pa, addr, sizeof(addr)), len);
+    return 0;
+}
+
+int
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+{
+    return arp_resolve_handle(iface, pa, ha, NULL);
+}
+
+/* NOTE: lock-free, only the changes of the entry resolved with the handle invalidate it */
+int
+arp_handle_is_valid(uint64_t handle)
+{
+    uint32_t idx;
+
+    idx = handle >> 32;
+    if (!idx || idx > capacity) {
+        return 0;
+    }
+    return __atomic_load_n(&caches[idx-1].gen, __ATOMIC_ACQUIRE) == (uint32_t)handle;
+}
+
+/* NOTE: lock-free, the state is changed by the timer */
+void
+arp_confirm(ip_addr_t pa)
+{
+    uint32_t i, idx;
+
+    if (!slots) {
+        return;
+    }
+    for (i = arp_cache_hash(pa); (idx = __atomic_load_n(&slots[i], __ATOMIC_ACQUIRE)); i = (i + 1) & mask) {
+        if (__atomic_load_n(&caches[idx-1].pa, __ATOMIC_RELAXED) == pa) {
+            if (!__atomic_load_n(&caches[idx-1].confirmed, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&caches[idx-1].confirmed, 1, __ATOMIC_RELAXED);
+            }
+            /* NOTE: in use, even if the callers skip arp_resolve() (e.g. struct ip_dst) */
+            if (!__atomic_load_n(&caches[idx-1].referenced, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&caches[idx-1].referenced, 1, __ATOMIC_RELAXED);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * NOTE: leaving REACHABLE changes the generation of the entry, the callers caching the
+ * address come back to arp_resolve() and the use of the entry is noticed (STALE -> DELAY)
+ */
+static void
+arp_cache_set_state(struct arp_cache *cache, unsigned char state, const struct timeval *now)
+{
+    char addr[IP_ADDR_STR_LEN];
+
+    arp_cache_write_begin(cache);
+    if (cache->state == ARP_CACHE_STATE_REACHABLE && state != ARP_CACHE_STATE_REACHABLE) {
+        cache->gen++;
+    }
+    cache->state = state;
+    arp_cache_write_end(cache);
+    cache->timestamp = *now;
+    debugf("pa=%s, state=%u", ip_addr_ntop(cache->pa, addr, sizeof(addr)), state);
+}
+
 static void
 arp_timer(void)
 {
@@ -312,15 +799,239 @@ arp_timer(void)
 
     mutex_lock(&mutex);
     gettimeofday(&now, NULL);
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->state != ARP_CACHE_STATE_STATIC) {
-            timersub(&now, &entry->timestamp, &diff);
+    for (entry = caches; entry < caches + capacity; entry++) {
+        if (entry->state == ARP_CACHE_STATE_FREE || entry->state == ARP_CACHE_STATE_STATIC) {
+            continue;
+        }
+        if (__atomic_exchange_n(&entry->confirmed, 0, __ATOMIC_RELAXED) && ARP_CACHE_STATE_IS_VALID(entry->state)) {
+            if (entry->state != ARP_CACHE_STATE_REACHABLE) {
+                arp_cache_set_state(entry, ARP_CACHE_STATE_REACHABLE, &now);
+            }
+            entry->timestamp = now;
+            entry->probes = 0;
+        }
+        timersub(&now, &entry->timestamp, &diff);
+        switch (entry->state) {
+        case ARP_CACHE_STATE_INCOMPLETE:
             if (diff.tv_sec > ARP_CACHE_TIMEOUT) {
                 arp_cache_delete(entry);
+            } else {
+                arp_solicit(entry, &now);
             }
+            break;
+        case ARP_CACHE_STATE_REACHABLE:
+            if (diff.tv_sec >= ARP_REACHABLE_TIME) {
+                __atomic_store_n(&entry->used, 0, __ATOMIC_RELAXED);
+                arp_cache_set_state(entry, ARP_CACHE_STATE_STALE, &now);
+            }
+            break;
+        case ARP_CACHE_STATE_STALE:
+            if (__atomic_exchange_n(&entry->used, 0, __ATOMIC_RELAXED)) {
+                arp_cache_set_state(entry, ARP_CACHE_STATE_DELAY, &now);
+            } else if (diff.tv_sec >= ARP_STALE_TIME) {
+                arp_cache_delete(entry);
+            }
+            break;
+        case ARP_CACHE_STATE_DELAY:
+            if (diff.tv_sec >= ARP_DELAY_TIME) {
+                arp_cache_set_state(entry, ARP_CACHE_STATE_PROBE, &now);
+                entry->probes = 0;
+                if (arp_request(entry->iface, entry->pa, entry->ha) == 0) {
+                    entry->probes++;
+                }
+            }
+            break;
+        case ARP_CACHE_STATE_PROBE:
+            if (entry->probes >= ARP_PROBE_MAX) {
+                arp_cache_delete(entry);
+            } else if (arp_request(entry->iface, entry->pa, entry->ha) == 0) {
+                /* NOTE: a request suppressed by the rate limit is not counted */
+                entry->probes++;
+            }
+            break;
+        }
+    }
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: must not be call after net_run() */
+int
+arp_set_cache_size(size_t size)
+{
+    if (!size || size > ARP_CACHE_SIZE_MAX) {
+        errorf("invalid size, size=%zu", size);
+        return -1;
+    }
+    if (arp_cache_setup(size) == -1) {
+        errorf("arp_cache_setup() failure");
+        return -1;
+    }
+    debugf("size=%zu, slots=%u", size, mask + 1);
+    return 0;
+}
+
+static struct net_iface *
+arp_iface_select(ip_addr_t pa)
+{
+    struct ip_iface *iface;
+
+    iface = ip_route_get_iface(pa);
+    if (!iface || NET_IFACE(iface)->dev->type != NET_DEVICE_TYPE_ETHERNET) {
+        return NULL;
+    }
+    return NET_IFACE(iface);
+}
+
+/* NOTE: after the interface is registered, replaces the entry (if any) and sends the packets waiting for it */
+int
+arp_add_static(const char *addr, const char *ha)
+{
+    ip_addr_t pa;
+    uint8_t hw[ETHER_ADDR_LEN];
+    struct net_iface *iface;
+    struct arp_cache *cache;
+    struct queue_head pending = {};
+
+    if (ip_addr_pton(addr, &pa) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", addr);
+        return -1;
+    }
+    if (ether_addr_pton(ha, hw) == -1) {
+        errorf("ether_addr_pton() failure, addr=%s", ha);
+        return -1;
+    }
+    iface = arp_iface_select(pa);
+    if (!iface) {
+        errorf("no ethernet interface for the address, addr=%s", addr);
+        return -1;
+    }
+    mutex_lock(&mutex);
+    cache = arp_cache_select(pa);
+    if (cache) {
+        arp_cache_write_begin(cache);
+        if (ARP_CACHE_STATE_IS_VALID(cache->state) && memcmp(cache->ha, hw, ETHER_ADDR_LEN) != 0) {
+            cache->gen++;
+        }
+        cache->state = ARP_CACHE_STATE_STATIC;
+        memcpy(cache->ha, hw, ETHER_ADDR_LEN);
+        arp_cache_write_end(cache);
+        cache->iface = iface;
+        pending = cache->pending;
+        queue_init(&cache->pending);
+    } else if (!arp_cache_insert(iface, pa, hw, ARP_CACHE_STATE_STATIC)) {
+        mutex_unlock(&mutex);
+        errorf("arp_cache_insert() failure");
+        return -1;
+    }
+    mutex_unlock(&mutex);
+    arp_pending_flush(&pending, hw);
+    infof("addr=%s, ha=%s", addr, ha);
+    return 0;
+}
+
+/*
+ * Snapshot of the resolved entries (except STATIC ones), a line per entry:
+ *
+ *   <protocol address> <hardware address>
+ *
+ * The file is replaced atomically (written to "<file>.tmp" and renamed).
+ */
+int
+arp_snapshot_save(const char *file)
+{
+    char tmp[256];
+    FILE *fp;
+    struct arp_cache *entry;
+    size_t n = 0;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[ETHER_ADDR_STR_LEN];
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", file) >= sizeof(tmp)) {
+        errorf("too long file name, file=%s", file);
+        return -1;
+    }
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        errorf("fopen() failure, file=%s", tmp);
+        return -1;
+    }
+    mutex_lock(&mutex);
+    /* NOTE: the least recently used first, the order is restored by loading them in sequence */
+    for (entry = lru.prev; entry != &lru; entry = entry->prev) {
+        if (!ARP_CACHE_STATE_IS_VALID(entry->state) || entry->state == ARP_CACHE_STATE_STATIC) {
+            continue;
         }
+        fprintf(fp, "%s %s\n",
+            ip_addr_ntop(entry->pa, addr1, sizeof(addr1)), ether_addr_ntop(entry->ha, addr2, sizeof(addr2)));
+        n++;
     }
     mutex_unlock(&mutex);
+    if (fclose(fp) == EOF || rename(tmp, file) == -1) {
+        errorf("failed to write, file=%s", file);
+        remove(tmp);
+        return -1;
+    }
+    infof("saved, file=%s, entries=%zu", file, n);
+    return 0;
+}
+
+/*
+ * Preload the entries saved by arp_snapshot_save() (after the interfaces are registered),
+ * they may be out of date, the ones used for sending are verified by NUD (STALE -> DELAY -> PROBE)
+ */
+int
+arp_snapshot_load(const char *file)
+{
+    FILE *fp;
+    char line[128], addr1[IP_ADDR_STR_LEN], addr2[ETHER_ADDR_STR_LEN];
+    ip_addr_t pa;
+    uint8_t ha[ETHER_ADDR_LEN];
+    struct net_iface *iface;
+    size_t n = 0, lineno = 0;
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        errorf("fopen() failure, file=%s", file);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (sscanf(line, "%15s %17s", addr1, addr2) != 2
+            || ip_addr_pton(addr1, &pa) == -1 || ether_addr_pton(addr2, ha) == -1) {
+            errorf("invalid line, file=%s, line=%zu", file, lineno);
+            continue;
+        }
+        iface = arp_iface_select(pa);
+        if (!iface) {
+            debugf("no ethernet interface for the address, addr=%s", addr1);
+            continue;
+        }
+        mutex_lock(&mutex);
+        /* NOTE: the entries resolved since the start are newer */
+        if (!arp_cache_select(pa) && arp_cache_insert(iface, pa, ha, ARP_CACHE_STATE_STALE)) {
+            n++;
+        }
+        mutex_unlock(&mutex);
+    }
+    fclose(fp);
+    infof("loaded, file=%s, entries=%zu", file, n);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+arp_set_rate_limit(unsigned int rate, unsigned int burst)
+{
+    if (rate > ARP_RATE_MAX || burst > ARP_RATE_MAX || (rate && !burst)) {
+        errorf("invalid parameter, rate=%u, burst=%u", rate, burst);
+        return -1;
+    }
+    ratelimit.rate = rate;
+    ratelimit.burst = burst;
+    ratelimit.credit = (uint64_t)burst * 1000000;
+    timerclear(&ratelimit.last);
+    debugf("rate=%u, burst=%u", rate, burst);
+    return 0;
 }
 
 int
@@ -328,6 +1039,11 @@ arp_init(void)
 {
     struct timeval interval = {1, 0};
 
+    if (!caches && arp_cache_setup(ARP_CACHE_SIZE) == -1) {
+        errorf("arp_cache_setup() failure");
+        return -1;
+    }
+
     if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
@@ -1,6 +1,7 @@
 #ifndef ARP_H
 #define ARP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "net.h"
@@ -13,6 +14,25 @@
 extern int
 arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
 extern int
+arp_resolve_handle(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, uint64_t *handle);
+extern int
+arp_handle_is_valid(uint64_t handle);
+extern void
+arp_confirm(ip_addr_t pa);
+extern int
+arp_enqueue(struct net_iface *iface, ip_addr_t pa, uint16_t type, const struct iovec *iov, int iovcnt,
+    int (*output)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst));
+extern int
+arp_add_static(const char *addr, const char *ha);
+extern int
+arp_snapshot_save(const char *file);
+extern int
+arp_snapshot_load(const char *file);
+extern int
+arp_set_cache_size(size_t size);
+extern int
+arp_set_rate_limit(unsigned int rate, unsigned int burst);
+extern int
 arp_init(void);
 
 #endif
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "capture.h"
+
+#define CAPTURE_RING_SIZE 1024 /* maximum number of slots (power of 2) */
+#define CAPTURE_RING_BYTES (8 * 1024 * 1024) /* the slots are fewer with a large snaplen */
+#define CAPTURE_BUFSIZ (1024 * 1024) /* stdio buffer of the output file */
+#define CAPTURE_WRITER_INTERVAL 10000000 /* nsec */
+
+#define CAPTURE_PCAP_MAGIC 0xa1b2c3d4
+
+#define CAPTURE_LINKTYPE_ETHERNET 1
+#define CAPTURE_LINKTYPE_RAW      101 /* raw IP */
+
+#define CAPTURE_TYPE_ARP 0x0806
+#define CAPTURE_TYPE_IP  0x0800
+
+struct capture_pcap_hdr {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct capture_pcap_rec {
+    uint32_t sec;
+    uint32_t usec;
+    uint32_t caplen;
+    uint32_t len;
+};
+
+/* NOTE: the data (snaplen bytes) follows immediately after the structure */
+struct capture_slot {
+    uint32_t seq;
+    struct capture_pcap_rec rec;
+};
+
+/*
+ * Bounded MPSC ring (producers are the RX/TX paths of any thread, the consumer is the writer
+ * thread of the capture, the file I/O never blocks the packet processing)
+ *
+ *   slot->seq == pos     : free for the producer of pos
+ *   slot->seq == pos + 1 : filled, ready for the consumer
+ */
+struct capture {
+    struct net_device *dev;
+    FILE *fp;
+    size_t snaplen;
+    size_t stride;
+    uint32_t num; /* number of slots (power of 2) */
+    int linktype;
+    uint16_t type;    /* 0: any */
+    uint8_t protocol; /* 0: any */
+    uint32_t users; /* producers in progress */
+    uint32_t tail; /* producer */
+    uint32_t head; /* consumer */
+    size_t frames;
+    size_t drops;
+    uint8_t *slots;
+    thread_t writer;
+    mutex_t mutex; /* for the writer to sleep */
+    struct sched_ctx ctx;
+    int stop;
+};
+
+#define CAPTURE_SLOT(x, i) ((struct capture_slot *)((x)->slots + ((i) & ((x)->num - 1)) * (x)->stride))
+
+static int
+capture_byte(const struct iovec *iov, int iovcnt, size_t off)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (off < iov[i].iov_len) {
+            return ((uint8_t *)iov[i].iov_base)[off];
+        }
+        off -= iov[i].iov_len;
+    }
+    return -1;
+}
+
+static int
+capture_match(struct capture *cap, const struct iovec *iov, int iovcnt)
+{
+    size_t base = 0;
+    uint16_t type;
+
+    if (!cap->type) {
+        return 1;
+    }
+    if (cap->linktype == CAPTURE_LINKTYPE_ETHERNET) {
+        type = capture_byte(iov, iovcnt, 12) << 8 | capture_byte(iov, iovcnt, 13);
+        base = 14;
+    } else {
+        type = ((capture_byte(iov, iovcnt, 0) & 0xf0) == 0x40) ? CAPTURE_TYPE_IP : 0;
+    }
+    if (type != cap->type) {
+        return 0;
+    }
+    if (cap->protocol && capture_byte(iov, iovcnt, base + 9) != cap->protocol) {
+        return 0;
+    }
+    return 1;
+}
+
+static void
+capture_enqueue(struct capture *cap, const struct iovec *iov, int iovcnt)
+{
+    struct capture_slot *slot;
+    struct timeval now;
+    uint32_t pos, seq;
+    size_t len;
+
+    pos = __atomic_load_n(&cap->tail, __ATOMIC_RELAXED);
+    while (1) {
+        slot = CAPTURE_SLOT(cap, pos);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&cap->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if ((int32_t)(seq - pos) < 0) {
+            /* full */
+            __atomic_add_fetch(&cap->drops, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&cap->tail, __ATOMIC_RELAXED);
+        }
+    }
+    gettimeofday(&now, NULL);
+    len = iovec_len(iov, iovcnt);
+    slot->rec.sec = now.tv_sec;
+    slot->rec.usec = now.tv_usec;
+    slot->rec.caplen = iovec_gather((uint8_t *)(slot + 1), cap->snaplen, iov, iovcnt);
+    slot->rec.len = len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    if (!((pos + 1) & (cap->num / 2 - 1))) {
+        /* NOTE: half of the ring is filled, do not wait for the interval */
+        sched_wakeup(&cap->ctx);
+    }
+}
+
+void
+capture_frame(struct net_device *dev, const uint8_t *hdr, size_t hlen, const uint8_t *data, size_t len)
+{
+    struct iovec iov[2];
+    int iovcnt = 0;
+
+    if (!CAPTURE_ENABLED(dev)) {
+        return;
+    }
+    if (hlen) {
+        iov[iovcnt].iov_base = (void *)hdr;
+        iov[iovcnt++].iov_len = hlen;
+    }
+    iov[iovcnt].iov_base = (void *)data;
+    iov[iovcnt++].iov_len = len;
+    capture_frame_iov(dev, iov, iovcnt);
+}
+
+static void
+capture_device(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    struct capture *cap;
+
+    cap = __atomic_load_n(&dev->capture, __ATOMIC_ACQUIRE);
+    if (!cap) {
+        return;
+    }
+    __atomic_add_fetch(&cap->users, 1, __ATOMIC_SEQ_CST);
+    /* NOTE: capture_stop() may have run between the load and the increment */
+    if (__atomic_load_n(&dev->capture, __ATOMIC_SEQ_CST) == cap && capture_match(cap, iov, iovcnt)) {
+        capture_enqueue(cap, iov, iovcnt);
+    }
+    __atomic_sub_fetch(&cap->users, 1, __ATOMIC_RELEASE);
+}
+
+void
+capture_frame_iov(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    capture_device(dev, iov, iovcnt);
+    if (dev->master) {
+        /* NOTE: the bond has no link of its own, it sees the frames of its members */
+        capture_device(dev->master, iov, iovcnt);
+    }
+}
+
+/* NOTE: called only by the writer thread (the consumer) */
+static void
+capture_flush(struct capture *cap)
+{
+    struct capture_slot *slot;
+
+    while (1) {
+        slot = CAPTURE_SLOT(cap, cap->head);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != cap->head + 1) {
+            break;
+        }
+        fwrite(&slot->rec, sizeof(slot->rec), 1, cap->fp);
+        fwrite(slot + 1, slot->rec.caplen, 1, cap->fp);
+        __atomic_store_n(&slot->seq, cap->head + cap->num, __ATOMIC_RELEASE);
+        cap->head++;
+        cap->frames++;
+    }
+    fflush(cap->fp);
+}
+
+static void *
+capture_writer(void *arg)
+{
+    struct capture *cap = (struct capture *)arg;
+    struct timespec abstime;
+
+    mutex_lock(&cap->mutex);
+    while (!cap->stop) {
+        mutex_unlock(&cap->mutex);
+        capture_flush(cap);
+        mutex_lock(&cap->mutex);
+        if (cap->stop) {
+            break;
+        }
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_nsec += CAPTURE_WRITER_INTERVAL;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+        sched_sleep(&cap->ctx, &cap->mutex, &abstime);
+    }
+    mutex_unlock(&cap->mutex);
+    /* NOTE: the producers have gone (see capture_stop), write the rest */
+    capture_flush(cap);
+    return NULL;
+}
+
+static int
+capture_filter_pton(const char *filter, uint16_t *type, uint8_t *protocol)
+{
+    *type = 0;
+    *protocol = 0;
+    if (!filter || !*filter) {
+        return 0;
+    }
+    if (strcmp(filter, "arp") == 0) {
+        *type = CAPTURE_TYPE_ARP;
+    } else if (strcmp(filter, "ip") == 0) {
+        *type = CAPTURE_TYPE_IP;
+    } else if (strcmp(filter, "icmp") == 0) {
+        *type = CAPTURE_TYPE_IP;
+        *protocol = 0x01;
+    } else if (strcmp(filter, "tcp") == 0) {
+        *type = CAPTURE_TYPE_IP;
+        *protocol = 0x06;
+    } else if (strcmp(filter, "udp") == 0) {
+        *type = CAPTURE_TYPE_IP;
+        *protocol = 0x11;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int
+capture_start(struct net_device *dev, const char *file, size_t snaplen, const char *filter)
+{
+    struct capture *cap;
+    struct capture_pcap_hdr hdr = {};
+    uint32_t i;
+    int err;
+
+    if (dev->capture) {
+        errorf("already started, dev=%s", dev->name);
+        return -1;
+    }
+    cap = memory_alloc(sizeof(*cap));
+    if (!cap) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    if (capture_filter_pton(filter, &cap->type, &cap->protocol) == -1) {
+        errorf("invalid filter, filter=%s", filter);
+        memory_free(cap);
+        return -1;
+    }
+    cap->dev = dev;
+    /* NOTE: the default does not follow a huge MTU (e.g. 65535 of loopback) */
+    cap->snaplen = snaplen ? MIN(snaplen, CAPTURE_SNAPLEN_MAX) : MIN((size_t)dev->hlen + dev->mtu, CAPTURE_SNAPLEN_DEFAULT);
+    cap->stride = (sizeof(struct capture_slot) + cap->snaplen + 7) & ~7;
+    cap->linktype = (dev->type == NET_DEVICE_TYPE_ETHERNET) ? CAPTURE_LINKTYPE_ETHERNET : CAPTURE_LINKTYPE_RAW;
+    for (cap->num = CAPTURE_RING_SIZE; cap->num > 2 && cap->num * cap->stride > CAPTURE_RING_BYTES; cap->num /= 2);
+    cap->slots = memory_alloc(cap->num * cap->stride);
+    if (!cap->slots) {
+        errorf("memory_alloc() failure");
+        memory_free(cap);
+        return -1;
+    }
+    for (i = 0; i < cap->num; i++) {
+        CAPTURE_SLOT(cap, i)->seq = i;
+    }
+    cap->fp = fopen(file, "w");
+    if (!cap->fp) {
+        errorf("fopen() failure, file=%s", file);
+        memory_free(cap->slots);
+        memory_free(cap);
+        return -1;
+    }
+    setvbuf(cap->fp, NULL, _IOFBF, CAPTURE_BUFSIZ);
+    hdr.magic = CAPTURE_PCAP_MAGIC;
+    hdr.major = 2;
+    hdr.minor = 4;
+    hdr.snaplen = cap->snaplen;
+    hdr.linktype = cap->linktype;
+    fwrite(&hdr, sizeof(hdr), 1, cap->fp);
+    mutex_init(&cap->mutex);
+    sched_ctx_init(&cap->ctx);
+    err = thread_create(&cap->writer, capture_writer, cap);
+    if (err) {
+        errorf("thread_create() failure, err=%d", err);
+        fclose(cap->fp);
+        memory_free(cap->slots);
+        memory_free(cap);
+        return -1;
+    }
+    __atomic_store_n(&dev->capture, cap, __ATOMIC_RELEASE);
+    infof("started, dev=%s, file=%s, snaplen=%zu, slots=%u, filter=%s",
+        dev->name, file, cap->snaplen, cap->num, filter ? filter : "(none)");
+    return 0;
+}
+
+int
+capture_stop(struct net_device *dev)
+{
+    struct capture *cap;
+
+    cap = dev->capture;
+    if (!cap) {
+        errorf("not started, dev=%s", dev->name);
+        return -1;
+    }
+    __atomic_store_n(&dev->capture, NULL, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&cap->users, __ATOMIC_ACQUIRE)) {
+        /* wait for the producers in progress */;
+    }
+    mutex_lock(&cap->mutex);
+    cap->stop = 1;
+    sched_wakeup(&cap->ctx);
+    mutex_unlock(&cap->mutex);
+    thread_join(cap->writer);
+    sched_ctx_destroy(&cap->ctx);
+    fclose(cap->fp);
+    infof("stopped, dev=%s, frames=%zu, drops=%zu", dev->name, cap->frames, cap->drops);
+    memory_free(cap->slots);
+    memory_free(cap);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "net.h"
+
+#define CAPTURE_SNAPLEN_MAX UINT16_MAX
+#define CAPTURE_SNAPLEN_DEFAULT 9216 /* upper limit when not specified (jumbo frames) */
+
+/* NOTE: the filter is one of "arp", "ip", "icmp", "tcp", "udp" or NULL (all frames) */
+extern int
+capture_start(struct net_device *dev, const char *file, size_t snaplen, const char *filter);
+extern int
+capture_stop(struct net_device *dev);
+
+/* NOTE: the frames of a bond member are recorded by the capture of the bond as well */
+#define CAPTURE_ENABLED(x) ((x)->capture || ((x)->master && (x)->master->capture))
+
+/* NOTE: a frame may be given in two parts (e.g. link header and payload) */
+extern void
+capture_frame(struct net_device *dev, const uint8_t *hdr, size_t hlen, const uint8_t *data, size_t len);
+extern void
+capture_frame_iov(struct net_device *dev, const struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+#include "ip.h"
+
+#include "bond.h"
+
+/*
+ * The bond transmits through one of its members (ethernet devices) and
+ * receives from all of them (see the master of struct net_device).
+ */
+struct bond {
+    int mode;
+    struct net_device *members[BOND_MEMBER_MAX];
+    unsigned int num;
+    unsigned int next; /* for round-robin */
+};
+
+#define PRIV(x) ((struct bond *)x->priv)
+
+/* NOTE: returns the number of the members taken into account (only the opened ones if up) */
+static unsigned int
+bond_update(struct net_device *dev, int up)
+{
+    struct bond *bond;
+    struct net_device *member;
+    unsigned int i, num = 0;
+
+    bond = PRIV(dev);
+    for (i = 0; i < bond->num; i++) {
+        member = bond->members[i];
+        if (up && !NET_DEVICE_IS_UP(member)) {
+            continue;
+        }
+        if (!num++) {
+            dev->mtu = member->mtu;
+            dev->features = member->features;
+            dev->gso_max_size = member->gso_max_size;
+        } else {
+            dev->mtu = MIN(dev->mtu, member->mtu);
+            dev->features &= member->features;
+            dev->gso_max_size = MIN(dev->gso_max_size, member->gso_max_size);
+        }
+    }
+    return num;
+}
+
+/* NOTE: the members are opened before the bond (see net_run), some adjust their MTU at open */
+static int
+bond_open(struct net_device *dev)
+{
+    struct bond *bond;
+    unsigned int num;
+
+    bond = PRIV(dev);
+    num = bond_update(dev, 1);
+    if (!num) {
+        errorf("no member is up, dev=%s", dev->name);
+        return -1;
+    }
+    infof("dev=%s, members=%u/%u, mtu=%u, features=0x%04x, gso_max_size=%u",
+        dev->name, num, bond->num, dev->mtu, dev->features, dev->gso_max_size);
+    return 0;
+}
+
+static unsigned int
+bond_hash(uint16_t type, const struct iovec *iov, int iovcnt)
+{
+    uint8_t ip[IP_HDR_SIZE_MAX + 4];
+    size_t len, hlen;
+    uint32_t hash;
+
+    if (type != NET_PROTOCOL_TYPE_IP) {
+        return 0;
+    }
+    len = iovec_gather(ip, sizeof(ip), iov, iovcnt);
+    if (len < IP_HDR_SIZE_MIN) {
+        return 0;
+    }
+    hash = (ip[12] << 24 | ip[13] << 16 | ip[14] << 8 | ip[15]) ^ (ip[16] << 24 | ip[17] << 16 | ip[18] << 8 | ip[19]);
+    hlen = (ip[0] & 0x0f) << 2;
+    if ((ip[9] == IP_PROTOCOL_TCP || ip[9] == IP_PROTOCOL_UDP) && !(ip[6] & 0x3f) && !ip[7] && len >= hlen + 4) {
+        /* TCP or UDP (not fragmented) */
+        hash ^= ip[hlen] << 24 | ip[hlen+1] << 16 | ip[hlen+2] << 8 | ip[hlen+3];
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static int
+bond_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    struct bond *bond;
+    struct net_device *up[BOND_MEMBER_MAX];
+    unsigned int i, num = 0, idx;
+
+    bond = PRIV(dev);
+    for (i = 0; i < bond->num; i++) {
+        if (NET_DEVICE_IS_UP(bond->members[i])) {
+            up[num++] = bond->members[i];
+        }
+    }
+    if (!num) {
+        errorf("no member is up, dev=%s", dev->name);
+        return -1;
+    }
+    switch (bond->mode) {
+    case BOND_MODE_ROUND_ROBIN:
+        idx = __atomic_fetch_add(&bond->next, 1, __ATOMIC_RELAXED);
+        break;
+    default:
+        idx = bond_hash(type, iov, iovcnt);
+        break;
+    }
+    return net_device_output_iov(up[idx % num], type, iov, iovcnt, dst);
+}
+
+static struct net_device_ops bond_ops = {
+    .open = bond_open,
+    .transmit_iov = bond_transmit_iov,
+};
+
+struct net_device *
+bond_init(const char *addr, int mode)
+{
+    struct net_device *dev;
+    struct bond *bond;
+
+    if (mode != BOND_MODE_ROUND_ROBIN && mode != BOND_MODE_L34_HASH) {
+        errorf("invalid mode, mode=%d", mode);
+        return NULL;
+    }
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &bond_ops;
+    bond = memory_alloc(sizeof(*bond));
+    if (!bond) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    bond->mode = mode;
+    dev->priv = bond;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(bond);
+        return NULL;
+    }
+    debugf("bond device initialized, dev=%s, mode=%s", dev->name, mode == BOND_MODE_ROUND_ROBIN ? "round-robin" : "l34-hash");
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+/* NOTE: the MTU and the features of the bond are the ones common to the opened members */
+int
+bond_add_member(struct net_device *dev, struct net_device *member)
+{
+    struct bond *bond;
+
+    if (dev->ops != &bond_ops) {
+        errorf("not a bond device, dev=%s", dev->name);
+        return -1;
+    }
+    if (member->type != NET_DEVICE_TYPE_ETHERNET || member->ops == &bond_ops) {
+        errorf("not an ethernet device, member=%s", member->name);
+        return -1;
+    }
+    if (member->master || member->ifaces) {
+        errorf("already in use, member=%s", member->name);
+        return -1;
+    }
+    bond = PRIV(dev);
+    if (bond->num >= BOND_MEMBER_MAX) {
+        errorf("too many members, dev=%s", dev->name);
+        return -1;
+    }
+    if (!bond->num && memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        if (memcmp(member->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) != 0) {
+            memcpy(dev->addr, member->addr, ETHER_ADDR_LEN);
+        } else {
+            /* locally administered address, unique in this process */
+            dev->addr[0] = 0x02;
+            dev->addr[ETHER_ADDR_LEN-1] = dev->index + 1;
+        }
+    }
+    /* NOTE: given before the member is opened, it is kept (not taken from the host) */
+    memcpy(member->addr, dev->addr, ETHER_ADDR_LEN);
+    member->master = dev;
+    bond->members[bond->num++] = member;
+    /* NOTE: provisional until open, for the settings made before net_run() (e.g. capture) */
+    bond_update(dev, 0);
+    debugf("dev=%s, member=%s, members=%u, mtu=%u", dev->name, member->name, bond->num, dev->mtu);
+    return 0;
+}
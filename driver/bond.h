@@ -0,0 +1,16 @@
+#ifndef BOND_H
+#define BOND_H
+
+#include "net.h"
+
+#define BOND_MEMBER_MAX 8
+
+#define BOND_MODE_ROUND_ROBIN 0 /* spread every frame (a flow may be reordered) */
+#define BOND_MODE_L34_HASH    1 /* hash of IPv4 addresses and ports (a flow stays on one member) */
+
+extern struct net_device *
+bond_init(const char *addr, int mode);
+extern int
+bond_add_member(struct net_device *dev, struct net_device *member);
+
+#endif
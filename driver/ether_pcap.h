@@ -5,5 +5,13 @@
 
 extern struct net_device *
 ether_pcap_init(const char *name, const char *addr);
+extern int
+ether_pcap_set_uring(struct net_device *dev, int sqpoll);
+extern int
+ether_pcap_set_mtu(struct net_device *dev, uint16_t mtu);
+extern int
+ether_pcap_set_coalesce(struct net_device *dev, const struct net_device_coalesce *param);
+extern int
+ether_pcap_get_coalesce_stats(struct net_device *dev, struct net_device_coalesce_stats *stats);
 
 #endif
@@ -0,0 +1,9 @@
+#ifndef ETHER_SHM_H
+#define ETHER_SHM_H
+
+#include "net.h"
+
+extern struct net_device *
+ether_shm_init(const char *name, const char *addr);
+
+#endif
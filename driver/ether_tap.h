@@ -3,7 +3,21 @@
 
 #include "net.h"
 
+#define ETHER_TAP_QUEUE_MAX 8
+
 extern struct net_device *
 ether_tap_init(const char *name, const char *addr);
+extern int
+ether_tap_set_queues(struct net_device *dev, unsigned int num);
+extern int
+ether_tap_set_offload(struct net_device *dev, int enable);
+extern int
+ether_tap_set_uring(struct net_device *dev, int sqpoll);
+extern int
+ether_tap_set_mtu(struct net_device *dev, uint16_t mtu);
+extern int
+ether_tap_set_coalesce(struct net_device *dev, const struct net_device_coalesce *param);
+extern int
+ether_tap_get_coalesce_stats(struct net_device *dev, struct net_device_coalesce_stats *stats);
 
 #endif
@@ -0,0 +1,15 @@
+#ifndef ETHER_UDP_H
+#define ETHER_UDP_H
+
+#include "net.h"
+
+#define ETHER_UDP_BATCH       32   /* datagrams per recvmmsg()/sendmmsg() */
+#define ETHER_UDP_QUEUE_LIMIT 1024 /* frames waiting for the TX thread */
+
+/* NOTE: the endpoints are "addr:port" of the host (e.g. "127.0.0.1:4789") */
+extern struct net_device *
+ether_udp_init(const char *addr, const char *local, const char *peer);
+extern int
+ether_udp_set_offload(struct net_device *dev, int enable);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef ETHER_VETH_H
+#define ETHER_VETH_H
+
+#include <stddef.h>
+
+#include "net.h"
+
+#define ETHER_VETH_LIMIT_DEFAULT 1000 /* frames in flight per direction */
+#define ETHER_VETH_LIMIT_MAX     4096
+
+/* NOTE: impairments on the frames transmitted by the device (like netem on egress) */
+struct ether_veth_netem {
+    unsigned long delay; /* usec */
+    unsigned long jitter; /* usec, uniformly distributed in [-jitter, +jitter] */
+    unsigned long rate; /* bits per second, 0: unlimited */
+    double loss; /* percent */
+    double reorder; /* percent, sent without the delay */
+    double duplicate; /* percent */
+    size_t limit; /* frames in flight, 0: ETHER_VETH_LIMIT_DEFAULT */
+};
+
+/* NOTE: the second one is created with the first one as its peer */
+extern struct net_device *
+ether_veth_init(const char *addr, struct net_device *peer);
+extern int
+ether_veth_set_netem(struct net_device *dev, const struct ether_veth_netem *netem);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef ETHER_VHOST_H
+#define ETHER_VHOST_H
+
+#include "net.h"
+
+extern struct net_device *
+ether_vhost_init(const char *name, const char *addr);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef ETHER_XDP_H
+#define ETHER_XDP_H
+
+#include "net.h"
+
+#define ETHER_XDP_MODE_COPY     0
+#define ETHER_XDP_MODE_ZEROCOPY 1
+
+extern struct net_device *
+ether_xdp_init(const char *name, const char *addr);
+extern int
+ether_xdp_set_mode(struct net_device *dev, int mode);
+
+#endif
@@ -8,17 +8,17 @@
 
 #define LOOPBACK_MTU UINT16_MAX /* maximum size of IP datagram */
 
+/* NOTE: the fragments are gathered into the input queue entry at once */
 static int
-loopback_transmit(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+loopback_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
 {
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    net_input_handler(type, data, len, dev);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, iovec_len(iov, iovcnt));
+    net_input_handler_iov(type, iov, iovcnt, dev, NET_INPUT_FLAG_CSUM_VALID); /* never leaves the host */
     return 0;
 }
 
 static struct net_device_ops loopback_ops = {
-    .transmit = loopback_transmit,
+    .transmit_iov = loopback_transmit_iov,
 };
 
 static void
@@ -29,6 +29,7 @@ loopback_setup(struct net_device *dev)
     dev->hlen = 0; /* non header */
     dev->alen = 0; /* non address */
     dev->flags = NET_DEVICE_FLAG_LOOPBACK;
+    dev->features = NET_DEVICE_FEATURE_CSUM_TX | NET_DEVICE_FEATURE_CSUM_RX;
     dev->ops = &loopback_ops;
 }
 
@@ -0,0 +1,17 @@
+#ifndef PCAP_REPLAY_H
+#define PCAP_REPLAY_H
+
+#include "net.h"
+
+#define PCAP_REPLAY_MODE_ORIGINAL 0 /* keep the captured timing */
+#define PCAP_REPLAY_MODE_SCALED   1 /* captured timing divided by speed */
+#define PCAP_REPLAY_MODE_FAST     2 /* as fast as possible */
+
+extern struct net_device *
+pcap_replay_init(const char *file, const char *addr);
+extern int
+pcap_replay_set_mode(struct net_device *dev, int mode, unsigned int speed);
+extern int
+pcap_replay_set_output(struct net_device *dev, const char *file);
+
+#endif
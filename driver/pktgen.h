@@ -0,0 +1,36 @@
+#ifndef PKTGEN_H
+#define PKTGEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+#define PKTGEN_RANDOM_SRC_ADDR 0x0001 /* host part of the source address (last octet) */
+#define PKTGEN_RANDOM_SRC_PORT 0x0002
+#define PKTGEN_RANDOM_DST_PORT 0x0004
+
+struct pktgen_stats {
+    uint64_t rx_packets; /* generated and injected into the stack */
+    uint64_t rx_bytes;
+    uint64_t processed; /* injected packets handled by the stack (ip_input and above) */
+    uint64_t tx_packets; /* transmitted by the stack and discarded */
+    uint64_t tx_bytes;
+    uint64_t latency_count; /* transmitted packets that echoed a generated payload */
+    uint64_t latency_sum; /* nsec */
+    uint64_t latency_max; /* nsec */
+    uint64_t elapsed; /* nsec */
+};
+
+extern struct net_device *
+pktgen_init(void);
+extern int
+pktgen_set_flow(struct net_device *dev, uint8_t protocol, const char *src, const char *dst, int random);
+extern int
+pktgen_set_size(struct net_device *dev, size_t min, size_t max);
+extern int
+pktgen_set_rate(struct net_device *dev, unsigned long pps, unsigned long count);
+extern int
+pktgen_get_stats(struct net_device *dev, struct pktgen_stats *stats);
+
+#endif
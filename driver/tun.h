@@ -0,0 +1,13 @@
+#ifndef TUN_H
+#define TUN_H
+
+#include <stdint.h>
+
+#include "net.h"
+
+extern struct net_device *
+tun_init(const char *name);
+extern int
+tun_set_mtu(struct net_device *dev, uint16_t mtu);
+
+#endif
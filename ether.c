@@ -7,6 +7,7 @@
 #include "util.h"
 #include "net.h"
 #include "ether.h"
+#include "capture.h"
 
 struct ether_hdr {
     uint8_t dst[ETHER_ADDR_LEN];
@@ -85,10 +86,15 @@ ether_dump(const uint8_t *frame, size_t flen)
 int
 ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
+    uint8_t frame[ETHER_JUMBO_FRAME_SIZE_MAX];
     struct ether_hdr *hdr;
     size_t flen, pad = 0;
 
+    if (len > dev->mtu) {
+        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
+        return -1;
+    }
+
     hdr = (struct ether_hdr *)frame;
     memcpy(hdr->dst, dst, ETHER_ADDR_LEN);
     memcpy(hdr->src, dev->addr, ETHER_ADDR_LEN);
@@ -96,26 +102,69 @@ ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data
     memcpy(hdr + 1, data, len);
     if (len < ETHER_PAYLOAD_SIZE_MIN) {
         pad = ETHER_PAYLOAD_SIZE_MIN - len;
+        memset((uint8_t *)(hdr + 1) + len, 0, pad);
     }
     flen = sizeof(*hdr) + len + pad;
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
     ether_dump(frame, flen);
+    if (CAPTURE_ENABLED(dev)) {
+        capture_frame(dev, NULL, 0, frame, flen);
+    }
     return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
 }
 
+/* NOTE: the header is prepended with an iovec, the payload is never copied */
 int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+ether_transmit_iov_helper(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, ssize_t (*callback)(struct net_device *dev, const struct iovec *iov, int iovcnt))
+{
+    static const uint8_t pad[ETHER_PAYLOAD_SIZE_MIN];
+    struct ether_hdr hdr;
+    struct iovec frame[1 + NET_DEVICE_IOV_MAX + 1]; /* header, payload and padding */
+    size_t len, flen;
+    int n = 0;
+
+    if (iovcnt > NET_DEVICE_IOV_MAX) {
+        errorf("too many fragments, dev=%s, iovcnt=%d", dev->name, iovcnt);
+        return -1;
+    }
+    len = iovec_len(iov, iovcnt);
+    if (len > dev->mtu) {
+        errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
+        return -1;
+    }
+    memcpy(hdr.dst, dst, ETHER_ADDR_LEN);
+    memcpy(hdr.src, dev->addr, ETHER_ADDR_LEN);
+    hdr.type = hton16(type);
+    frame[n].iov_base = &hdr;
+    frame[n++].iov_len = sizeof(hdr);
+    memcpy(&frame[n], iov, sizeof(*iov) * iovcnt);
+    n += iovcnt;
+    if (len < ETHER_PAYLOAD_SIZE_MIN) {
+        frame[n].iov_base = (void *)pad;
+        frame[n++].iov_len = ETHER_PAYLOAD_SIZE_MIN - len;
+    }
+    flen = sizeof(hdr) + MAX(len, (size_t)ETHER_PAYLOAD_SIZE_MIN);
+    debugf("dev=%s, type=%s(0x%04x), len=%zu, iovcnt=%d", dev->name, ether_type_ntoa(hdr.type), type, flen, n);
+    ether_dump((uint8_t *)&hdr, sizeof(hdr));
+    if (CAPTURE_ENABLED(dev)) {
+        capture_frame_iov(dev, frame, n);
+    }
+    return callback(dev, frame, n) == (ssize_t)flen ? 0 : -1;
+}
+
+int
+ether_input_helper(struct net_device *dev, const uint8_t *frame, size_t flen, int flags)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
-    ssize_t flen;
     struct ether_hdr *hdr;
     uint16_t type;
 
-    flen = callback(dev, frame, sizeof(frame));
-    if (flen < (ssize_t)sizeof(*hdr)) {
+    if (flen < sizeof(*hdr)) {
         errorf("input data is too short");
         return -1;
     }
+    if (CAPTURE_ENABLED(dev)) {
+        capture_frame(dev, NULL, 0, frame, flen);
+    }
     hdr = (struct ether_hdr *)frame;
     if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
         if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
@@ -126,7 +175,20 @@ ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device
     type = ntoh16(hdr->type);
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
     ether_dump(frame, flen);
-    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev, flags);
+}
+
+int
+ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+{
+    uint8_t frame[ETHER_JUMBO_FRAME_SIZE_MAX];
+    ssize_t flen;
+
+    flen = callback(dev, frame, dev->hlen + dev->mtu);
+    if (flen == -1) {
+        return -1;
+    }
+    return ether_input_helper(dev, frame, flen, 0);
 }
 
 void
@@ -139,3 +201,20 @@ ether_setup_helper(struct net_device *dev)
     dev->alen = ETHER_ADDR_LEN;
     memcpy(dev->broadcast, ETHER_ADDR_BROADCAST, ETHER_ADDR_LEN);
 }
+
+/* NOTE: must not be call after net_run() */
+int
+ether_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (dev->type != NET_DEVICE_TYPE_ETHERNET) {
+        errorf("not an ethernet device, dev=%s", dev->name);
+        return -1;
+    }
+    if (mtu < ETHER_PAYLOAD_SIZE_MIN || mtu > ETHER_JUMBO_PAYLOAD_SIZE_MAX) {
+        errorf("invalid mtu, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    dev->mtu = mtu;
+    debugf("dev=%s, mtu=%u", dev->name, mtu);
+    return 0;
+}
@@ -17,6 +17,10 @@
 #define ETHER_PAYLOAD_SIZE_MIN (ETHER_FRAME_SIZE_MIN - ETHER_HDR_SIZE)
 #define ETHER_PAYLOAD_SIZE_MAX (ETHER_FRAME_SIZE_MAX - ETHER_HDR_SIZE)
 
+/* NOTE: the default MTU is ETHER_PAYLOAD_SIZE_MAX, jumbo frames are enabled per device */
+#define ETHER_JUMBO_PAYLOAD_SIZE_MAX 9216
+#define ETHER_JUMBO_FRAME_SIZE_MAX (ETHER_HDR_SIZE + ETHER_JUMBO_PAYLOAD_SIZE_MAX)
+
 /* see https://www.iana.org/assignments/ieee-802-numbers/ieee-802-numbers.txt */
 #define ETHER_TYPE_IP   0x0800
 #define ETHER_TYPE_ARP  0x0806
@@ -33,10 +37,17 @@ ether_addr_ntop(const uint8_t *n, char *p, size_t size);
 extern int
 ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *payload, size_t plen, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *buf, size_t len));
 extern int
+ether_transmit_iov_helper(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst, ssize_t (*callback)(struct net_device *dev, const struct iovec *iov, int iovcnt));
+extern int
+ether_input_helper(struct net_device *dev, const uint8_t *frame, size_t flen, int flags);
+extern int
 ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size));
 extern void
 ether_setup_helper(struct net_device *net_device);
 
+extern int
+ether_set_mtu(struct net_device *dev, uint16_t mtu);
+
 extern struct net_device *
 ether_init(const char *name);
 
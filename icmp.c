@@ -81,7 +81,7 @@ icmp_dump(const uint8_t *data, size_t len)
 }
 
 static void
-icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
 {
     struct icmp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
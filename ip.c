@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "platform.h"
 
@@ -14,15 +15,16 @@ struct ip_protocol {
     struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags);
 };
 
 struct ip_route {
-    struct ip_route *next;
+    struct ip_route *next; /* hash chain (or free list) */
     ip_addr_t network;
     ip_addr_t netmask;
     ip_addr_t nexthop;
     struct ip_iface *iface;
+    uint8_t len; /* prefix length */
 };
 
 struct ip_hdr {
@@ -39,13 +41,27 @@ struct ip_hdr {
     uint8_t options[0];
 };
 
+struct pseudo_hdr {
+    uint32_t src;
+    uint32_t dst;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t len;
+};
+
+/* NOTE: TCP header fields touched by GSO/GRO */
+#define IP_TCP_HDR_SIZE_MIN 20
+#define IP_TCP_HDR_SIZE_MAX 60
+#define IP_TCP_FLG_FIN 0x01
+#define IP_TCP_FLG_PSH 0x08
+#define IP_TCP_FLG_ACK 0x10
+
 const ip_addr_t IP_ADDR_ANY       = 0x00000000; /* 0.0.0.0 */
 const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct ip_iface *ifaces;
 static struct ip_protocol *protocols;
-static struct ip_route *routes;
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -147,53 +163,408 @@ ip_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
-/* NOTE: must not be call after net_run() */
+/*
+ * Routing table: multibit trie with the strides of 16, 8 and 8 bits (DIR-16-8-8)
+ *
+ *   level 0 : 65536 entries indexed by the upper 16 bits of the destination (/0 - /16)
+ *   level 1 : groups of 256 entries for the next 8 bits (/17 - /24)
+ *   level 2 : groups of 256 entries for the last 8 bits (/25 - /32)
+ *
+ * An entry is empty (0), a route (its address | 1), or a group of the next level.
+ * The route of an entry is the longest prefix covering it, a lookup takes at most
+ * three memory accesses regardless of the number of routes.
+ *
+ * The routes are also kept in a hash table keyed by the prefix (for the updates).
+ * The writers are serialized by the mutex. ip_route_lookup() walks the trie without it
+ * under a sequence counter, the routes and groups released are recycled (never freed)
+ * so that a reader racing with a writer never touches freed memory.
+ */
+#define IP_ROUTE_LEVELS 3
+#define IP_ROUTE_GROUP_SIZE 256
+#define IP_ROUTE_HASH_SIZE_MIN 256
+
+#define IP_ROUTE_IS_GROUP(x) ((x) && !((x) & 1))
+#define IP_ROUTE_GROUP(x) ((uintptr_t *)(x))
+#define IP_ROUTE_ENTRY(x) ((struct ip_route *)((x) & ~(uintptr_t)1))
+#define IP_ROUTE_LEAF(x) ((uintptr_t)(x) | 1)
+
+static const uint8_t ip_route_ends[IP_ROUTE_LEVELS] = {16, 24, 32};
+
+static mutex_t route_mutex = MUTEX_INITIALIZER;
+static uint32_t route_seq; /* odd while being written (for the lock-free readers) */
+static uintptr_t route_table[1 << 16];
+static struct ip_route **route_hash;
+static size_t route_hash_size; /* power of 2 */
+static size_t route_count;
+static struct ip_route *route_frees;
+static uintptr_t *group_frees; /* linked through the first entry */
+
+static uint8_t
+ip_route_prefixlen(ip_addr_t netmask)
+{
+    uint32_t mask;
+    uint8_t len = 0;
+
+    for (mask = ntoh32(netmask); mask & 0x80000000; mask <<= 1) {
+        len++;
+    }
+    return len;
+}
+
+static ip_addr_t
+ip_route_netmask(uint8_t len)
+{
+    return len ? hton32(0xffffffff << (32 - len)) : 0;
+}
+
+static uint32_t
+ip_route_hash(ip_addr_t network, uint8_t len)
+{
+    uint32_t hash;
+
+    hash = network ^ len;
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return hash & (route_hash_size - 1);
+}
+
+static struct ip_route *
+ip_route_select(ip_addr_t network, uint8_t len)
+{
+    struct ip_route *route;
+
+    if (!route_hash) {
+        return NULL;
+    }
+    for (route = route_hash[ip_route_hash(network, len)]; route; route = route->next) {
+        if (route->network == network && route->len == len) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+static int
+ip_route_hash_grow(void)
+{
+    struct ip_route **old, *route, *next;
+    size_t old_size, i;
+    uint32_t h;
+
+    old = route_hash;
+    old_size = route_hash_size;
+    route_hash_size = old_size ? old_size * 2 : IP_ROUTE_HASH_SIZE_MIN;
+    route_hash = memory_alloc(sizeof(*route_hash) * route_hash_size);
+    if (!route_hash) {
+        errorf("memory_alloc() failure");
+        route_hash = old;
+        route_hash_size = old_size;
+        return -1;
+    }
+    for (i = 0; i < old_size; i++) {
+        for (route = old[i]; route; route = next) {
+            next = route->next;
+            h = ip_route_hash(route->network, route->len);
+            route->next = route_hash[h];
+            route_hash[h] = route;
+        }
+    }
+    if (old) {
+        memory_free(old);
+    }
+    return 0;
+}
+
+static void
+ip_route_write_begin(void)
+{
+    __atomic_store_n(&route_seq, route_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+ip_route_write_end(void)
+{
+    __atomic_store_n(&route_seq, route_seq + 1, __ATOMIC_RELEASE);
+}
+
+static uintptr_t *
+ip_route_group_alloc(uintptr_t fill)
+{
+    uintptr_t *group;
+    int i;
+
+    group = group_frees;
+    if (group) {
+        group_frees = (uintptr_t *)group[0];
+    } else {
+        group = memory_alloc(sizeof(*group) * IP_ROUTE_GROUP_SIZE);
+        if (!group) {
+            return NULL;
+        }
+    }
+    for (i = 0; i < IP_ROUTE_GROUP_SIZE; i++) {
+        group[i] = fill;
+    }
+    return group;
+}
+
+/* NOTE: replace the group with a single entry when all of its entries are the same route (or empty) */
+static void
+ip_route_group_collapse(uintptr_t *slot)
+{
+    uintptr_t *group, value;
+    int i;
+
+    group = IP_ROUTE_GROUP(*slot);
+    value = group[0];
+    if (IP_ROUTE_IS_GROUP(value)) {
+        return;
+    }
+    for (i = 1; i < IP_ROUTE_GROUP_SIZE; i++) {
+        if (group[i] != value) {
+            return;
+        }
+    }
+    __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+    group[0] = (uintptr_t)group_frees;
+    group_frees = group;
+}
+
+/*
+ * Store the new value to an entry covered by the prefix (and the entries of its groups)
+ *   insert: the entries of a shorter (or the same) prefix
+ *   delete: the entries of the old route (the new one is the next longest prefix)
+ */
+static void
+ip_route_fill(uintptr_t *slot, uint8_t len, uintptr_t old, uintptr_t new)
+{
+    uintptr_t e;
+    int i;
+
+    e = *slot;
+    if (IP_ROUTE_IS_GROUP(e)) {
+        for (i = 0; i < IP_ROUTE_GROUP_SIZE; i++) {
+            ip_route_fill(&IP_ROUTE_GROUP(e)[i], len, old, new);
+        }
+        if (old) {
+            ip_route_group_collapse(slot);
+        }
+        return;
+    }
+    if (old ? (e == old) : (!e || IP_ROUTE_ENTRY(e)->len <= len)) {
+        __atomic_store_n(slot, new, __ATOMIC_RELEASE);
+    }
+}
+
+static int
+ip_route_update(uintptr_t *table, int level, uint32_t network, uint8_t len, uintptr_t old, uintptr_t new)
+{
+    uint8_t begin, end;
+    uint32_t idx, n, i;
+    uintptr_t *group;
+    int ret;
+
+    begin = level ? ip_route_ends[level-1] : 0;
+    end = ip_route_ends[level];
+    idx = (network >> (32 - end)) & ((1 << (end - begin)) - 1);
+    if (len > end) {
+        if (!IP_ROUTE_IS_GROUP(table[idx])) {
+            if (old) {
+                /* NOTE: the route to be deleted is not here */
+                return 0;
+            }
+            group = ip_route_group_alloc(table[idx]);
+            if (!group) {
+                errorf("ip_route_group_alloc() failure");
+                return -1;
+            }
+            /* NOTE: the group has been filled, publish it to the readers */
+            __atomic_store_n(&table[idx], (uintptr_t)group, __ATOMIC_RELEASE);
+        }
+        ret = ip_route_update(IP_ROUTE_GROUP(table[idx]), level + 1, network, len, old, new);
+        if (old) {
+            ip_route_group_collapse(&table[idx]);
+        }
+        return ret;
+    }
+    n = 1 << (end - len);
+    for (i = idx; i < idx + n; i++) {
+        ip_route_fill(&table[i], len, old, new);
+    }
+    return 0;
+}
+
+static uintptr_t
+ip_route_walk(uint32_t addr)
+{
+    uintptr_t e;
+
+    e = __atomic_load_n(&route_table[addr >> 16], __ATOMIC_ACQUIRE);
+    if (IP_ROUTE_IS_GROUP(e)) {
+        e = __atomic_load_n(&IP_ROUTE_GROUP(e)[(addr >> 8) & 0xff], __ATOMIC_ACQUIRE);
+        if (IP_ROUTE_IS_GROUP(e)) {
+            e = __atomic_load_n(&IP_ROUTE_GROUP(e)[addr & 0xff], __ATOMIC_ACQUIRE);
+        }
+    }
+    return e;
+}
+
+/* NOTE: replaces the route of the same prefix (if any) */
 static struct ip_route *
-ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+ip_route_insert(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
 {
     struct ip_route *route;
+    uint8_t len;
+    uint32_t h;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
-    route = memory_alloc(sizeof(*route));
-    if (!route) {
-        errorf("memory_alloc() failure");
+    len = ip_route_prefixlen(netmask);
+    if (netmask != ip_route_netmask(len) || (network & ~netmask)) {
+        errorf("invalid prefix, network=%s, netmask=%s",
+            ip_addr_ntop(network, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
         return NULL;
     }
-    route->network = network;
-    route->netmask = netmask;
-    route->nexthop = nexthop;
-    route->iface = iface;
-    route->next = routes;
-    routes = route;
-    infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
-        ip_addr_ntop(route->network, addr1, sizeof(addr1)),
-        ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
-        ip_addr_ntop(route->nexthop, addr3, sizeof(addr3)),
-        ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
+    mutex_lock(&route_mutex);
+    route = ip_route_select(network, len);
+    if (route) {
+        ip_route_write_begin();
+        route->nexthop = nexthop;
+        route->iface = iface;
+        ip_route_write_end();
+    } else {
+        if (route_count >= route_hash_size && ip_route_hash_grow() == -1) {
+            mutex_unlock(&route_mutex);
+            errorf("ip_route_hash_grow() failure");
+            return NULL;
+        }
+        route = route_frees;
+        if (route) {
+            route_frees = route->next;
+        } else {
+            route = memory_alloc(sizeof(*route));
+            if (!route) {
+                mutex_unlock(&route_mutex);
+                errorf("memory_alloc() failure");
+                return NULL;
+            }
+        }
+        route->network = network;
+        route->netmask = netmask;
+        route->nexthop = nexthop;
+        route->iface = iface;
+        route->len = len;
+        ip_route_write_begin();
+        if (ip_route_update(route_table, 0, ntoh32(network), len, 0, IP_ROUTE_LEAF(route)) == -1) {
+            /* NOTE: nothing has been filled, only the groups on the way may be left (harmless) */
+            ip_route_write_end();
+            route->next = route_frees;
+            route_frees = route;
+            mutex_unlock(&route_mutex);
+            errorf("ip_route_update() failure");
+            return NULL;
+        }
+        ip_route_write_end();
+        h = ip_route_hash(network, len);
+        route->next = route_hash[h];
+        route_hash[h] = route;
+        route_count++;
+    }
+    mutex_unlock(&route_mutex);
+    debugf("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
+        ip_addr_ntop(network, addr1, sizeof(addr1)),
+        ip_addr_ntop(netmask, addr2, sizeof(addr2)),
+        ip_addr_ntop(nexthop, addr3, sizeof(addr3)),
+        ip_addr_ntop(iface->unicast, addr4, sizeof(addr4)),
         NET_IFACE(iface)->dev->name
     );
     return route;
 }
 
-static struct ip_route *
-ip_route_lookup(ip_addr_t dst)
+static int
+ip_route_remove(ip_addr_t network, uint8_t len)
 {
-    struct ip_route *route, *candidate = NULL;
+    struct ip_route *route, **p, *parent = NULL;
+    int l;
 
-    for (route = routes; route; route = route->next) {
-        if ((dst & route->netmask) == route->network) {
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
-            }
+    mutex_lock(&route_mutex);
+    route = ip_route_select(network, len);
+    if (!route) {
+        mutex_unlock(&route_mutex);
+        return -1;
+    }
+    /* NOTE: the entries of the route fall back to the next longest prefix covering it */
+    for (l = len - 1; l >= 0 && !parent; l--) {
+        parent = ip_route_select(network & ip_route_netmask(l), l);
+    }
+    ip_route_write_begin();
+    ip_route_update(route_table, 0, ntoh32(network), len, IP_ROUTE_LEAF(route), parent ? IP_ROUTE_LEAF(parent) : 0);
+    ip_route_write_end();
+    for (p = &route_hash[ip_route_hash(network, len)]; *p != route; p = &(*p)->next);
+    *p = route->next;
+    route_count--;
+    route->next = route_frees;
+    route_frees = route;
+    mutex_unlock(&route_mutex);
+    return 0;
+}
+
+/* NOTE: lock-free, falls back to the mutex while a writer is updating the table */
+static int
+ip_route_lookup(ip_addr_t dst, struct ip_route *result)
+{
+    uint32_t seq;
+    uintptr_t e;
+
+    seq = __atomic_load_n(&route_seq, __ATOMIC_ACQUIRE);
+    if (!(seq & 1)) {
+        e = ip_route_walk(ntoh32(dst));
+        if (e) {
+            *result = *IP_ROUTE_ENTRY(e);
         }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&route_seq, __ATOMIC_RELAXED) == seq) {
+            return e ? 0 : -1;
+        }
+    }
+    mutex_lock(&route_mutex);
+    e = ip_route_walk(ntoh32(dst));
+    if (e) {
+        *result = *IP_ROUTE_ENTRY(e);
     }
-    return candidate;
+    mutex_unlock(&route_mutex);
+    return e ? 0 : -1;
+}
+
+static int
+ip_route_prefix_pton(const char *p, ip_addr_t *network, uint8_t *len)
+{
+    char addr[IP_ADDR_STR_LEN] = {};
+    char *sep, *ep;
+    long int ret;
+
+    sep = strrchr(p, '/');
+    if (!sep || (size_t)(sep - p) >= sizeof(addr)) {
+        return -1;
+    }
+    memcpy(addr, p, sep - p);
+    if (ip_addr_pton(addr, network) == -1) {
+        return -1;
+    }
+    ret = strtol(sep + 1, &ep, 10);
+    if (ep == sep + 1 || *ep != '\0' || ret < 0 || ret > 32) {
+        return -1;
+    }
+    *len = ret;
+    /* NOTE: the host bits are ignored (e.g. "192.0.2.1/24") */
+    *network &= ip_route_netmask(*len);
+    return 0;
 }
 
-/* NOTE: must not be call after net_run() */
 int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
 {
@@ -203,8 +574,64 @@ ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
         errorf("ip_addr_pton() failure, addr=%s", gateway);
         return -1;
     }
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
-        errorf("ip_route_add() failure");
+    if (!ip_route_insert(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
+        errorf("ip_route_insert() failure");
+        return -1;
+    }
+    return 0;
+}
+
+int
+ip_route_add_host(struct ip_iface *iface, const char *host)
+{
+    ip_addr_t addr;
+
+    if (ip_addr_pton(host, &addr) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", host);
+        return -1;
+    }
+    /* NOTE: more specific than the network route, wins even if the network is also attached to another iface */
+    if (!ip_route_insert(addr, IP_ADDR_BROADCAST, IP_ADDR_ANY, iface)) {
+        errorf("ip_route_insert() failure");
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: the prefix is "a.b.c.d/len", the nexthop is NULL for the directly connected network */
+int
+ip_route_add(struct ip_iface *iface, const char *prefix, const char *nexthop)
+{
+    ip_addr_t network, gw = IP_ADDR_ANY;
+    uint8_t len;
+
+    if (ip_route_prefix_pton(prefix, &network, &len) == -1) {
+        errorf("invalid prefix, prefix=%s", prefix);
+        return -1;
+    }
+    if (nexthop && ip_addr_pton(nexthop, &gw) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", nexthop);
+        return -1;
+    }
+    if (!ip_route_insert(network, ip_route_netmask(len), gw, iface)) {
+        errorf("ip_route_insert() failure");
+        return -1;
+    }
+    return 0;
+}
+
+int
+ip_route_delete(const char *prefix)
+{
+    ip_addr_t network;
+    uint8_t len;
+
+    if (ip_route_prefix_pton(prefix, &network, &len) == -1) {
+        errorf("invalid prefix, prefix=%s", prefix);
+        return -1;
+    }
+    if (ip_route_remove(network, len) == -1) {
+        errorf("no such route, prefix=%s", prefix);
         return -1;
     }
     return 0;
@@ -213,13 +640,24 @@ ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
 struct ip_iface *
 ip_route_get_iface(ip_addr_t dst)
 {
-    struct ip_route *route;
+    struct ip_route route;
 
-    route = ip_route_lookup(dst);
-    if (!route) {
+    if (ip_route_lookup(dst, &route) == -1) {
         return NULL;
     }
-    return route->iface;
+    return route.iface;
+}
+
+/* NOTE: called on forward progress of the upper layer (e.g. new data acknowledged by TCP) */
+void
+ip_route_confirm(ip_addr_t dst)
+{
+    struct ip_route route;
+
+    if (ip_route_lookup(dst, &route) == -1 || !(NET_IFACE(route.iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP)) {
+        return;
+    }
+    arp_confirm(route.nexthop != IP_ADDR_ANY ? route.nexthop : dst);
 }
 
 struct ip_iface *
@@ -259,8 +697,8 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface)
         errorf("net_device_add_iface() failure");
         return -1;
     }
-    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
-        errorf("ip_route_add() failure");
+    if (!ip_route_insert(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
+        errorf("ip_route_insert() failure");
         return -1;
     }
     iface->next = ifaces;
@@ -286,8 +724,106 @@ ip_iface_select(ip_addr_t addr)
     return entry;
 }
 
+static uint16_t
+ip_tcp_cksum(const struct ip_hdr *hdr, const uint8_t *tcp, size_t len)
+{
+    struct pseudo_hdr pseudo;
+
+    pseudo.src = hdr->src;
+    pseudo.dst = hdr->dst;
+    pseudo.zero = 0;
+    pseudo.protocol = IP_PROTOCOL_TCP;
+    pseudo.len = hton16(len);
+    return cksum16((uint16_t *)tcp, len, ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0));
+}
+
+/*
+ * GRO: merge an in-order TCP segment of the same flow into the preceding one,
+ * so that tcp_input() runs once per merged segment instead of once per MSS.
+ * Only plain ACK segments are extended, a PSH ends the merged segment.
+ */
+static int
+ip_gro(uint8_t *buf, size_t size, size_t *len, int *flags, const uint8_t *data, size_t dlen, int dflags)
+{
+    struct ip_hdr *hdr;
+    const struct ip_hdr *next;
+    uint8_t *tcp;
+    const uint8_t *ntcp;
+    size_t total, ntotal, thlen, plen, nplen;
+    uint32_t seq, nseq;
+
+    hdr = (struct ip_hdr *)buf;
+    next = (const struct ip_hdr *)data;
+    if (*len < IP_HDR_SIZE_MIN + IP_TCP_HDR_SIZE_MIN || dlen < IP_HDR_SIZE_MIN + IP_TCP_HDR_SIZE_MIN) {
+        return -1;
+    }
+    /* IPv4 without options, not fragmented */
+    if (hdr->vhl != ((IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2)) || next->vhl != hdr->vhl) {
+        return -1;
+    }
+    if (hdr->protocol != IP_PROTOCOL_TCP || next->protocol != IP_PROTOCOL_TCP) {
+        return -1;
+    }
+    if (hdr->src != next->src || hdr->dst != next->dst || hdr->tos != next->tos || hdr->ttl != next->ttl) {
+        return -1;
+    }
+    if ((ntoh16(hdr->offset) | ntoh16(next->offset)) & 0x3fff) {
+        return -1;
+    }
+    total = ntoh16(hdr->total);
+    ntotal = ntoh16(next->total);
+    if (total > *len || ntotal > dlen) {
+        return -1;
+    }
+    tcp = buf + IP_HDR_SIZE_MIN;
+    ntcp = data + IP_HDR_SIZE_MIN;
+    thlen = (tcp[12] >> 4) << 2;
+    if (thlen < IP_TCP_HDR_SIZE_MIN || total < IP_HDR_SIZE_MIN + thlen || ntotal < IP_HDR_SIZE_MIN + thlen) {
+        return -1;
+    }
+    /* same ports, same header length and options */
+    if (memcmp(tcp, ntcp, 4) != 0 || ntcp[12] != tcp[12] || memcmp(tcp + IP_TCP_HDR_SIZE_MIN, ntcp + IP_TCP_HDR_SIZE_MIN, thlen - IP_TCP_HDR_SIZE_MIN) != 0) {
+        return -1;
+    }
+    if (tcp[13] != IP_TCP_FLG_ACK || (ntcp[13] & ~IP_TCP_FLG_PSH) != IP_TCP_FLG_ACK) {
+        return -1;
+    }
+    plen = total - (IP_HDR_SIZE_MIN + thlen);
+    nplen = ntotal - (IP_HDR_SIZE_MIN + thlen);
+    memcpy(&seq, tcp + 4, sizeof(seq));
+    memcpy(&nseq, ntcp + 4, sizeof(nseq));
+    if (!plen || !nplen || ntoh32(seq) + plen != ntoh32(nseq)) {
+        return -1;
+    }
+    if (total + nplen > MIN(size, IP_TOTAL_SIZE_MAX)) {
+        return -1;
+    }
+    /* NOTE: the headers of the next one are dropped, and the merged one can't be verified later */
+    if (cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0) != 0 || cksum16((uint16_t *)next, IP_HDR_SIZE_MIN, 0) != 0) {
+        return -1;
+    }
+    if (!(*flags & NET_INPUT_FLAG_CSUM_VALID) && ip_tcp_cksum(hdr, tcp, total - IP_HDR_SIZE_MIN) != 0) {
+        return -1;
+    }
+    if (!(dflags & NET_INPUT_FLAG_CSUM_VALID) && ip_tcp_cksum(next, ntcp, ntotal - IP_HDR_SIZE_MIN) != 0) {
+        return -1;
+    }
+    memcpy(buf + total, ntcp + thlen, nplen);
+    total += nplen;
+    hdr->total = hton16(total);
+    hdr->sum = 0;
+    hdr->sum = cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0);
+    /* the latest ACK, window and PSH */
+    memcpy(tcp + 8, ntcp + 8, 4);
+    memcpy(tcp + 14, ntcp + 14, 2);
+    tcp[13] = ntcp[13];
+    *len = total;
+    *flags |= NET_INPUT_FLAG_CSUM_VALID;
+    return 0;
+}
+
 static void
-ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+ip_input(const uint8_t *data, size_t len, struct net_device *dev, int flags)
 {
     struct ip_hdr *hdr;
     uint8_t v;
@@ -341,59 +877,164 @@ ip_input(const uint8_t *data, size_t len, struct net_device *dev)
     ip_dump(data, total);
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
+            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface, flags);
             return;
         }
     }
     /* unsupported protocol */
 }
 
+/*
+ * Software GSO: cut a TCP segment larger than MTU into MTU-sized ones
+ * for the devices without TSO, just before handing them to the device.
+ * Only the headers are copied, the payload of each piece is passed as it is.
+ */
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_gso(struct net_device *dev, const uint8_t *iphdr, size_t hlen, const uint8_t *data, size_t len, const void *hwaddr)
+{
+    uint8_t buf[IP_HDR_SIZE_MAX + IP_TCP_HDR_SIZE_MAX];
+    struct iovec iov[2];
+    const struct ip_hdr *hdr;
+    struct ip_hdr *seg;
+    struct pseudo_hdr pseudo;
+    uint8_t *tcp;
+    size_t thlen, mss, off, plen, payload;
+    uint32_t seq, nseq;
+    uint16_t id, psum, sum;
+
+    hdr = (const struct ip_hdr *)iphdr;
+    thlen = (len > 12) ? (data[12] >> 4) << 2 : 0;
+    if (hdr->protocol != IP_PROTOCOL_TCP || thlen < IP_TCP_HDR_SIZE_MIN || len < thlen || dev->mtu <= hlen + thlen) {
+        errorf("unable to segment, dev=%s, protocol=%u, len=%zu", dev->name, hdr->protocol, hlen + len);
+        return -1;
+    }
+    mss = dev->mtu - (hlen + thlen);
+    payload = len - thlen;
+    memcpy(&seq, data + 4, sizeof(seq));
+    seq = ntoh32(seq);
+    id = ntoh16(hdr->id);
+    memcpy(buf, iphdr, hlen);
+    memcpy(buf + hlen, data, thlen);
+    seg = (struct ip_hdr *)buf;
+    tcp = buf + hlen;
+    for (off = 0; off < payload; off += plen) {
+        plen = MIN(mss, payload - off);
+        seg->total = hton16(hlen + thlen + plen);
+        seg->id = hton16(id++);
+        seg->sum = 0;
+        seg->sum = cksum16((uint16_t *)seg, hlen, 0);
+        nseq = hton32(seq + off);
+        memcpy(tcp + 4, &nseq, sizeof(nseq));
+        if (off + plen < payload) {
+            /* NOTE: FIN and PSH belong to the last segment only */
+            tcp[13] = data[13] & ~(IP_TCP_FLG_FIN | IP_TCP_FLG_PSH);
+        } else {
+            tcp[13] = data[13];
+        }
+        pseudo.src = seg->src;
+        pseudo.dst = seg->dst;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_TCP;
+        pseudo.len = hton16(thlen + plen);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        memset(tcp + 16, 0, sizeof(sum));
+        if (dev->features & NET_DEVICE_FEATURE_CSUM_TX) {
+            sum = psum; /* partial checksum, completed by the device */
+        } else {
+            /* NOTE: thlen is a multiple of 4, the sum continues over the payload */
+            sum = cksum16((uint16_t *)(data + thlen + off), plen, (uint16_t)~cksum16((uint16_t *)tcp, thlen, psum));
+        }
+        memcpy(tcp + 16, &sum, sizeof(sum));
+        iov[0].iov_base = buf;
+        iov[0].iov_len = hlen + thlen;
+        iov[1].iov_base = (void *)(data + thlen + off);
+        iov[1].iov_len = plen;
+        if (net_device_output_iov(dev, NET_PROTOCOL_TYPE_IP, iov, countof(iov), hwaddr) == -1) {
+            return -1;
+        }
+    }
+    debugf("dev=%s, len=%zu, mss=%zu, segments=%zu", dev->name, hlen + len, mss, (payload + mss - 1) / mss);
+    return 0;
+}
+
+/* NOTE: a packet held while resolving the next hop, segments larger than MTU are cut here */
+static int
+ip_output_pending(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+{
+    size_t hlen;
+
+    hlen = (data[0] & 0x0f) << 2;
+    if (len > dev->mtu && !(dev->features & NET_DEVICE_FEATURE_TSO)) {
+        return ip_output_gso(dev, data, hlen, data + hlen, len - hlen, dst);
+    }
+    return net_device_output(dev, type, data, len, dst);
+}
+
+/*
+ * NOTE: the header and the payload are handed to the device separately (no copy),
+ * ha is the hardware address of the next hop resolved by the caller (NULL: resolve here)
+ */
+static int
+ip_output_device(struct ip_iface *iface, const uint8_t *hdr, size_t hlen, const uint8_t *data, size_t len, ip_addr_t dst, const uint8_t *ha)
 {
     uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
+    struct iovec iov[2];
     int ret;
 
-    if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
+    if (ha) {
+        memcpy(hwaddr, ha, NET_IFACE(iface)->dev->alen);
+    } else if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
         if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
             memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
         } else {
             ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
             if (ret != ARP_RESOLVE_FOUND) {
+                if (ret == ARP_RESOLVE_INCOMPLETE) {
+                    /* NOTE: held by the ARP cache entry, sent when resolved (cut by GSO then if needed) */
+                    iov[0].iov_base = (void *)hdr;
+                    iov[0].iov_len = hlen;
+                    iov[1].iov_base = (void *)data;
+                    iov[1].iov_len = len;
+                    arp_enqueue(NET_IFACE(iface), dst, NET_PROTOCOL_TYPE_IP, iov, countof(iov), ip_output_pending);
+                }
                 return ret;
             }
         }
     }
-    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    if (hlen + len > NET_IFACE(iface)->dev->mtu && !(NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_TSO)) {
+        return ip_output_gso(NET_IFACE(iface)->dev, hdr, hlen, data, len, hwaddr);
+    }
+    iov[0].iov_base = (void *)hdr;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return net_device_output_iov(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, iov, countof(iov), hwaddr);
 }
 
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, const uint8_t *ha, uint16_t id, uint16_t offset)
 {
-    uint8_t buf[IP_TOTAL_SIZE_MAX];
-    struct ip_hdr *hdr;
+    struct ip_hdr hdr;
     uint16_t hlen, total;
     char addr[IP_ADDR_STR_LEN];
 
-    hdr = (struct ip_hdr *)buf;
-    hlen = sizeof(*hdr);
-    hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
-    hdr->tos = 0;
+    hlen = sizeof(hdr);
+    hdr.vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
+    hdr.tos = 0;
     total = hlen + len;
-    hdr->total = hton16(total);
-    hdr->id = hton16(id);
-    hdr->offset = hton16(offset);
-    hdr->ttl = 0xff;
-    hdr->protocol = protocol;
-    hdr->sum = 0;
-    hdr->src = src;
-    hdr->dst = dst;
-    hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert byteorder */
-    memcpy(hdr+1, data, len);
+    hdr.total = hton16(total);
+    hdr.id = hton16(id);
+    hdr.offset = hton16(offset);
+    hdr.ttl = 0xff;
+    hdr.protocol = protocol;
+    hdr.sum = 0;
+    hdr.src = src;
+    hdr.dst = dst;
+    hdr.sum = cksum16((uint16_t *)&hdr, hlen, 0); /* don't convert byteorder */
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+    ip_dump((uint8_t *)&hdr, hlen);
+    return ip_output_device(iface, (uint8_t *)&hdr, hlen, data, len, nexthop, ha);
 }
 
 static uint16_t
@@ -409,37 +1050,140 @@ ip_generate_id(void)
     return ret;
 }
 
+static int
+ip_dst_is_valid(struct ip_dst *cache, ip_addr_t dst)
+{
+    return cache->valid && cache->dst == dst
+        && cache->route_gen == __atomic_load_n(&route_seq, __ATOMIC_ACQUIRE)
+        && (!cache->arp_handle || arp_handle_is_valid(cache->arp_handle));
+}
+
+/*
+ * Fill the cache with the route and the hardware address of the next hop, it stays
+ * invalid while the address is being resolved (the packet goes through arp_resolve())
+ */
+static int
+ip_dst_fill(struct ip_dst *cache, ip_addr_t dst)
+{
+    struct ip_route route;
+    struct net_device *dev;
+
+    cache->valid = 0;
+    /* NOTE: the generation is taken before the lookup, a change in between invalidates the cache */
+    cache->route_gen = __atomic_load_n(&route_seq, __ATOMIC_ACQUIRE);
+    cache->arp_handle = 0;
+    if (ip_route_lookup(dst, &route) == -1) {
+        return -1;
+    }
+    cache->dst = dst;
+    cache->iface = route.iface;
+    cache->nexthop = (route.nexthop != IP_ADDR_ANY) ? route.nexthop : dst;
+    dev = NET_IFACE(route.iface)->dev;
+    memset(cache->ha, 0, sizeof(cache->ha));
+    if (dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
+        if (cache->nexthop == route.iface->broadcast || cache->nexthop == IP_ADDR_BROADCAST) {
+            memcpy(cache->ha, dev->broadcast, dev->alen);
+        } else if (arp_resolve_handle(NET_IFACE(route.iface), cache->nexthop, cache->ha, &cache->arp_handle) != ARP_RESOLVE_FOUND) {
+            return 0;
+        }
+    }
+    /* NOTE: the odd sequence (a writer was updating the table) never matches again */
+    cache->valid = !(cache->route_gen & 1);
+    return 0;
+}
+
+/* NOTE: the interface to reach the destination, without a lookup while the cache is valid */
+struct ip_iface *
+ip_dst_get_iface(struct ip_dst *cache, ip_addr_t dst)
+{
+    if (!cache) {
+        return ip_route_get_iface(dst);
+    }
+    if (!ip_dst_is_valid(cache, dst) && ip_dst_fill(cache, dst) == -1) {
+        return NULL;
+    }
+    return cache->iface;
+}
+
+/*
+ * The next hop is reachable (e.g. new data acknowledged), the ARP entry stays REACHABLE
+ *
+ * NOTE: at most once per second, the forward progress of a connection is reported per ACK
+ */
+void
+ip_dst_confirm(struct ip_dst *cache)
+{
+    time_t now;
+
+    if (!cache->valid || !cache->arp_handle) {
+        return;
+    }
+    now = time(NULL);
+    if (cache->confirmed == now) {
+        return;
+    }
+    cache->confirmed = now;
+    arp_confirm(cache->nexthop);
+}
+
 ssize_t
 ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
 {
-    struct ip_route *route;
+    return ip_output_dst(NULL, protocol, data, len, src, dst);
+}
+
+/*
+ * Output with the destination cache of a connection (NULL: no cache), the route lookup
+ * and the address resolution are skipped while it is valid
+ *
+ * NOTE: the callers must serialize the use of the cache (e.g. under the mutex of the PCB)
+ */
+ssize_t
+ip_output_dst(struct ip_dst *cache, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+{
+    struct ip_route route;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     ip_addr_t nexthop;
+    const uint8_t *ha = NULL;
     uint16_t id;
 
     if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
         errorf("source address is required for broadcast addresses");
         return -1;
     }
-    route = ip_route_lookup(dst);
-    if (!route) {
-        errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
-        return -1;
+    if (cache) {
+        if (!ip_dst_is_valid(cache, dst) && ip_dst_fill(cache, dst) == -1) {
+            errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+            return -1;
+        }
+        iface = cache->iface;
+        nexthop = cache->nexthop;
+        if (cache->valid) {
+            ha = cache->ha;
+        }
+    } else {
+        if (ip_route_lookup(dst, &route) == -1) {
+            errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+            return -1;
+        }
+        iface = route.iface;
+        nexthop = (route.nexthop != IP_ADDR_ANY) ? route.nexthop : dst;
     }
-    iface = route->iface;
     if (src != IP_ADDR_ANY && src != iface->unicast) {
         errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
         return -1;
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
     if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%u, tatal=%zu",
-            NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
-        return -1;
+        /* NOTE: TCP segments larger than MTU are cut by the device (TSO) or by ip_output_gso() */
+        if (protocol != IP_PROTOCOL_TCP || NET_DEVICE_GSO_SIZE(NET_IFACE(iface)->dev) < IP_HDR_SIZE_MIN + len) {
+            errorf("too long, dev=%s, mtu=%u, gso_max_size=%u, tatal=%zu",
+                NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, NET_DEVICE_GSO_SIZE(NET_IFACE(iface)->dev), IP_HDR_SIZE_MIN + len);
+            return -1;
+        }
     }
     id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, ha, id, 0) == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
@@ -448,7 +1192,7 @@ ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_a
 
 /* NOTE: must not be call after net_run() */
 int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags))
 {
     struct ip_protocol *entry;
 
@@ -492,5 +1236,9 @@ ip_init(void)
         errorf("net_protocol_register() failure");
         return -1;
     }
+    if (net_protocol_set_gro(NET_PROTOCOL_TYPE_IP, ip_gro) == -1) {
+        errorf("net_protocol_set_gro() failure");
+        return -1;
+    }
     return 0;
 }
@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "net.h"
 
@@ -40,6 +41,21 @@ struct ip_iface {
     ip_addr_t broadcast;
 };
 
+/*
+ * Destination cache of a connection: the route and the next-hop hardware address,
+ * valid until the routing table or the ARP entry of the next hop changes (see ip_output_dst)
+ */
+struct ip_dst {
+    int valid;
+    ip_addr_t dst;
+    struct ip_iface *iface;
+    ip_addr_t nexthop;
+    uint8_t ha[NET_DEVICE_ADDR_LEN];
+    uint32_t route_gen;
+    uint64_t arp_handle; /* 0: no address resolution */
+    time_t confirmed; /* the last time the next hop was confirmed */
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IP_ADDR_BROADCAST;
 
@@ -54,8 +70,16 @@ ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
+extern int
+ip_route_add_host(struct ip_iface *iface, const char *host);
+extern int
+ip_route_add(struct ip_iface *iface, const char *prefix, const char *nexthop);
+extern int
+ip_route_delete(const char *prefix);
 extern struct ip_iface *
 ip_route_get_iface(ip_addr_t dst);
+extern void
+ip_route_confirm(ip_addr_t dst);
 
 extern struct ip_iface *
 ip_iface_alloc(const char *addr, const char *netmask);
@@ -64,11 +88,18 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface);
 extern struct ip_iface *
 ip_iface_select(ip_addr_t addr);
 
+extern struct ip_iface *
+ip_dst_get_iface(struct ip_dst *cache, ip_addr_t dst);
+extern void
+ip_dst_confirm(struct ip_dst *cache);
+
 extern ssize_t
 ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+extern ssize_t
+ip_output_dst(struct ip_dst *cache, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
 
 extern int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags));
 extern char *
 ip_protocol_name(uint8_t type);
 
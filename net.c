@@ -10,19 +10,24 @@
 
 #include "util.h"
 #include "net.h"
+#include "capture.h"
+
+#define NET_PROTOCOL_GRO_SIZE_MAX UINT16_MAX
 
 struct net_protocol {
     struct net_protocol *next;
     char name[16];
     uint16_t type;
     struct queue_head queue; /* input queue */
-    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev);
+    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev, int flags);
+    int (*gro)(uint8_t *buf, size_t size, size_t *len, int *flags, const uint8_t *data, size_t dlen, int dflags);
 };
 
 /* NOTE: the data follows immediately after the structure */
 struct net_protocol_queue_entry {
     struct net_device *dev;
     size_t len;
+    int flags;
 };
 
 struct net_timer {
@@ -45,6 +50,9 @@ static struct net_protocol *protocols;
 static struct net_timer *timers;
 static struct net_event *events;
 
+/* NOTE: protect the protocol input queues, drivers may push from their own threads */
+static mutex_t mutex = MUTEX_INITIALIZER;
+
 struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev))
 {
@@ -75,6 +83,16 @@ net_device_register(struct net_device *dev)
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int
+net_device_set_gso_max_size(struct net_device *dev, uint16_t size)
+{
+    /* NOTE: the MTU or less disables GSO/TSO, the packets are built in MTU-sized pieces */
+    dev->gso_max_size = size;
+    debugf("dev=%s, gso_max_size=%u", dev->name, dev->gso_max_size);
+    return 0;
+}
+
 static int
 net_device_open(struct net_device *dev)
 {
@@ -145,17 +163,55 @@ net_device_get_iface(struct net_device *dev, int family)
 int
 net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
 {
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return net_device_output_iov(dev, type, &iov, 1, dst);
+}
+
+int
+net_device_output_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    uint8_t *buf;
+    size_t len;
+    int ret;
+
     if (!NET_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
-    if (len > dev->mtu) {
+    if (iovcnt > NET_DEVICE_IOV_MAX) {
+        errorf("too many fragments, dev=%s, iovcnt=%d", dev->name, iovcnt);
+        return -1;
+    }
+    len = iovec_len(iov, iovcnt);
+    if (len > dev->mtu && !(dev->features & NET_DEVICE_FEATURE_TSO)) {
         errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
         return -1;
     }
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
+    debugf("dev=%s, type=%s(0x%04x), len=%zu, iovcnt=%d", dev->name, net_protocol_name(type), type, len, iovcnt);
+    if (dev->capture && !dev->hlen) {
+        /* NOTE: devices with a link header are captured by their helper (e.g. ether_transmit_helper) */
+        capture_frame_iov(dev, iov, iovcnt);
+    }
+    if (dev->ops->transmit_iov) {
+        ret = dev->ops->transmit_iov(dev, type, iov, iovcnt, dst);
+    } else if (iovcnt == 1) {
+        ret = dev->ops->transmit(dev, type, iov[0].iov_base, len, dst);
+    } else {
+        /* NOTE: the device takes only a contiguous buffer (allocated here, not on the stack of every transmit) */
+        buf = memory_alloc(len);
+        if (!buf) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        iovec_gather(buf, len, iov, iovcnt);
+        debugdump(buf, len);
+        ret = dev->ops->transmit(dev, type, buf, len, dst);
+        memory_free(buf);
+    }
+    if (ret == -1) {
         errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
         return -1;
     }
@@ -163,11 +219,32 @@ net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, si
 }
 
 int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev, int flags)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+    return net_input_handler_iov(type, &iov, 1, dev, flags);
+}
+
+/* NOTE: the fragments are gathered into the queue entry (no intermediate buffer) */
+int
+net_input_handler_iov(uint16_t type, const struct iovec *iov, int iovcnt, struct net_device *dev, int flags)
 {
     struct net_protocol *proto;
     struct net_protocol_queue_entry *entry;
+    unsigned int num;
+    size_t len;
 
+    if (dev->capture && !dev->hlen) {
+        capture_frame_iov(dev, iov, iovcnt);
+    }
+    if (dev->master) {
+        /* NOTE: the upper layers see only the bond (the interfaces are registered on it) */
+        dev = dev->master;
+    }
+    len = iovec_len(iov, iovcnt);
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == type) {
             entry = memory_alloc(sizeof(*entry) + len);
@@ -177,14 +254,21 @@ net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_dev
             }
             entry->dev = dev;
             entry->len = len;
-            memcpy(entry+1, data, len);
+            entry->flags = flags;
+            iovec_gather((uint8_t *)(entry+1), len, iov, iovcnt);
+            debugdump((uint8_t *)(entry+1), len);
+            mutex_lock(&mutex);
             if (!queue_push(&proto->queue, entry)) {
+                mutex_unlock(&mutex);
                 errorf("queue_push() failure");
                 memory_free(entry);
                 return -1;
             }
-            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", proto->queue.num, dev->name, proto->name, type, len);
-            debugdump(data, len);
+            /* NOTE: counted before the unlock, the softirq can not handle it earlier */
+            __atomic_add_fetch(&dev->backlog, 1, __ATOMIC_RELAXED);
+            num = proto->queue.num;
+            mutex_unlock(&mutex);
+            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", num, dev->name, proto->name, type, len);
             raise_softirq();
             return 0;
         }
@@ -195,7 +279,7 @@ net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_dev
 
 /* NOTE: must not be call after net_run() */
 int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
+net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev, int flags))
 {
     struct net_protocol *proto;
 
@@ -219,6 +303,23 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int
+net_protocol_set_gro(uint16_t type, int (*gro)(uint8_t *buf, size_t size, size_t *len, int *flags, const uint8_t *data, size_t dlen, int dflags))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->gro = gro;
+            infof("type=%s(0x%04x)", proto->name, type);
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
 char *
 net_protocol_name(uint16_t type)
 {
@@ -232,23 +333,76 @@ net_protocol_name(uint16_t type)
     return "UNKNOWN";
 }
 
+/*
+ * GRO: merge the following entries of the same device into the popped one while
+ * the protocol accepts them, the batch is what has been queued up to this point.
+ * Returns the length of the merged data in buf, or 0 if nothing is merged.
+ *
+ * NOTE: only the softirq pops the queues, so the peeked entry stays at the head
+ */
+static size_t
+net_protocol_gro(struct net_protocol *proto, struct net_protocol_queue_entry *entry, uint8_t *buf, size_t size, int *flags)
+{
+    struct net_protocol_queue_entry *next;
+    size_t len = 0;
+    unsigned int merged = 0;
+
+    while (1) {
+        mutex_lock(&mutex);
+        next = queue_peek(&proto->queue);
+        mutex_unlock(&mutex);
+        if (!next || next->dev != entry->dev) {
+            break;
+        }
+        if (!merged) {
+            memcpy(buf, entry+1, entry->len);
+            len = entry->len;
+            *flags = entry->flags;
+        }
+        if (proto->gro(buf, size, &len, flags, (uint8_t *)(next+1), next->len, next->flags) == -1) {
+            break;
+        }
+        mutex_lock(&mutex);
+        queue_pop(&proto->queue);
+        mutex_unlock(&mutex);
+        memory_free(next);
+        __atomic_sub_fetch(&entry->dev->backlog, 1, __ATOMIC_RELEASE);
+        merged++;
+    }
+    if (!merged) {
+        return 0;
+    }
+    debugf("merged %u entries, dev=%s, type=%s(0x%04x), len=%zu", merged + 1, entry->dev->name, proto->name, proto->type, len);
+    return len;
+}
+
 int
 net_protocol_handler(void)
 {
+    static uint8_t buf[NET_PROTOCOL_GRO_SIZE_MAX]; /* NOTE: used only by the softirq */
     struct net_protocol *proto;
     struct net_protocol_queue_entry *entry;
     unsigned int num;
+    size_t len;
+    int flags;
 
     for (proto = protocols; proto; proto = proto->next) {
         while (1) {
+            mutex_lock(&mutex);
             entry = queue_pop(&proto->queue);
+            num = proto->queue.num;
+            mutex_unlock(&mutex);
             if (!entry) {
                 break;
             }
-            num = proto->queue.num;
             debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", num, entry->dev->name, proto->type, entry->len);
             debugdump((uint8_t *)(entry+1), entry->len);
-            proto->handler((uint8_t *)(entry+1), entry->len, entry->dev);
+            if (proto->gro && (len = net_protocol_gro(proto, entry, buf, sizeof(buf), &flags)) != 0) {
+                proto->handler(buf, len, entry->dev, flags);
+            } else {
+                proto->handler((uint8_t *)(entry+1), entry->len, entry->dev, entry->flags);
+            }
+            __atomic_sub_fetch(&entry->dev->backlog, 1, __ATOMIC_RELEASE);
             free(entry);
         }
     }
@@ -339,8 +493,16 @@ net_run(void)
         return -1;
     }
     debugf("open all devices...");
+    /* NOTE: the members of a bond first, the bond takes over their MTU and features at open */
     for (dev = devices; dev; dev = dev->next) {
-        net_device_open(dev);
+        if (dev->master) {
+            net_device_open(dev);
+        }
+    }
+    for (dev = devices; dev; dev = dev->next) {
+        if (!dev->master) {
+            net_device_open(dev);
+        }
     }
     debugf("running...");
     return 0;
@@ -353,6 +515,9 @@ net_shutdown(void)
 
     debugf("close all devices...");
     for (dev = devices; dev; dev = dev->next) {
+        if (dev->capture) {
+            capture_stop(dev);
+        }
         net_device_close(dev);
     }
     debugf("shutdown");
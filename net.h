@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <sys/uio.h>
 
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
@@ -13,6 +14,7 @@
 #define NET_DEVICE_TYPE_NULL      0x0000
 #define NET_DEVICE_TYPE_LOOPBACK  0x0001
 #define NET_DEVICE_TYPE_ETHERNET  0x0002
+#define NET_DEVICE_TYPE_TUN       0x0003 /* raw IP, no link header */
 
 #define NET_DEVICE_FLAG_UP        0x0001
 #define NET_DEVICE_FLAG_LOOPBACK  0x0010
@@ -20,9 +22,18 @@
 #define NET_DEVICE_FLAG_P2P       0x0040
 #define NET_DEVICE_FLAG_NEED_ARP  0x0100
 
+#define NET_DEVICE_FEATURE_CSUM_TX 0x0001 /* device completes a partial L4 checksum */
+#define NET_DEVICE_FEATURE_CSUM_RX 0x0002 /* device verifies L4 checksum */
+#define NET_DEVICE_FEATURE_TSO     0x0004 /* device segments TCP segments larger than MTU */
+
+#define NET_DEVICE_GSO_MAX_SIZE UINT16_MAX /* gso_max_size of the devices opting in (e.g. TSO) */
+
 #define NET_DEVICE_ADDR_LEN 16
 
+#define NET_DEVICE_IOV_MAX 8 /* payload fragments passed to transmit_iov */
+
 #define NET_DEVICE_IS_UP(x) ((x)->flags & NET_DEVICE_FLAG_UP)
+#define NET_DEVICE_GSO_SIZE(x) ((x)->gso_max_size > (x)->mtu ? (x)->gso_max_size : (x)->mtu)
 #define NET_DEVICE_STATE(x) (NET_DEVICE_IS_UP(x) ? "up" : "down")
 
 #define NET_IFACE_FAMILY_IP    1
@@ -35,6 +46,8 @@
 #define NET_PROTOCOL_TYPE_ARP  0x0806
 #define NTT_PROTOCOL_TYPE_IPV6 0x86dd
 
+#define NET_INPUT_FLAG_CSUM_VALID 0x0001 /* L4 checksum has already been verified */
+
 #define NET_IRQ_SHARED 0x0001
 
 struct net_device; /* forward declaration */
@@ -46,10 +59,38 @@ struct net_iface {
     /* depends on implementation of protocols. */
 };
 
+/*
+ * RX notification coalescing (cf. ethtool -C)
+ *
+ * While coalescing, the notifications from the device are disarmed and the device
+ * is polled every usecs. The notifications are re-armed when a poll finds fewer
+ * than frames frames (the burst is over). With adaptive, the parameters are chosen
+ * by the packet rate: notify immediately below rate_low, use usecs_high/frames_high
+ * above rate_high, and usecs/frames in between.
+ */
+struct net_device_coalesce {
+    int adaptive;
+    uint32_t usecs; /* 0: notify immediately */
+    uint32_t frames;
+    uint32_t rate_low; /* pkt/s */
+    uint32_t rate_high; /* pkt/s */
+    uint32_t usecs_high;
+    uint32_t frames_high;
+};
+
+struct net_device_coalesce_stats {
+    uint64_t notifications; /* by the device */
+    uint64_t polls; /* by the hold-off timer */
+    uint64_t frames; /* frames per notification = frames / (notifications + polls) */
+    uint64_t empty; /* notifications and polls that found no frame */
+    uint64_t rate; /* pkt/s (last sample) */
+};
+
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
     int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+    int (*transmit_iov)(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst); /* optional, preferred over transmit */
     int (*poll)(struct net_device *dev);
 };
 
@@ -61,6 +102,8 @@ struct net_device {
     uint16_t type;
     uint16_t mtu;
     uint16_t flags;
+    uint16_t features;
+    uint16_t gso_max_size; /* largest packet built by the upper layers, cut by the device (TSO) or by the stack (GSO), 0: none */
     uint16_t hlen; /* header length */
     uint16_t alen; /* address length */
     uint8_t addr[NET_DEVICE_ADDR_LEN];
@@ -70,6 +113,9 @@ struct net_device {
     };
     struct net_device_ops *ops;
     void *priv;
+    struct capture *capture; /* NULL unless capturing (see capture.h) */
+    struct net_device *master; /* NULL unless a member of a bond (see driver/bond.h) */
+    unsigned int backlog; /* input queue entries not yet handled by the protocols */
 };
 
 extern struct net_device *
@@ -77,17 +123,25 @@ net_device_alloc(void (*setup)(struct net_device *dev));
 extern int
 net_device_register(struct net_device *dev);
 extern int
+net_device_set_gso_max_size(struct net_device *dev, uint16_t size);
+extern int
 net_device_add_iface(struct net_device *dev, struct net_iface *iface);
 extern struct net_iface *
 net_device_get_iface(struct net_device *dev, int family);
 extern int
 net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+extern int
+net_device_output_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst);
 
 extern int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev, int flags);
+extern int
+net_input_handler_iov(uint16_t type, const struct iovec *iov, int iovcnt, struct net_device *dev, int flags);
 
 extern int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev, int flags));
+extern int
+net_protocol_set_gro(uint16_t type, int (*gro)(uint8_t *buf, size_t size, size_t *len, int *flags, const uint8_t *data, size_t dlen, int dflags));
 extern char *
 net_protocol_name(uint16_t type);
 extern int
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE /* for F_SETSIG */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+
+#include "driver/ether_notify.h"
+
+#define ETHER_NOTIFY_SAMPLE_INTERVAL 10000000 /* nsec */
+
+static uint64_t
+ether_notify_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+ether_notify_arm(struct ether_notify *notify, int enable)
+{
+    int flags;
+
+    flags = fcntl(notify->fd, F_GETFL);
+    if (flags == -1) {
+        errorf("fcntl(F_GETFL): %s, dev=%s", strerror(errno), notify->dev->name);
+        return -1;
+    }
+    flags = enable ? (flags | O_ASYNC) : (flags & ~O_ASYNC);
+    if (fcntl(notify->fd, F_SETFL, flags) == -1) {
+        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), notify->dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+ether_notify_holdoff(struct ether_notify *notify, uint32_t usecs)
+{
+    struct itimerspec its = {};
+
+    its.it_value.tv_sec = usecs / 1000000;
+    its.it_value.tv_nsec = (usecs % 1000000) * 1000;
+    if (timer_settime(notify->timer, 0, &its, NULL) == -1) {
+        errorf("timer_settime: %s, dev=%s", strerror(errno), notify->dev->name);
+    }
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_notify_set_coalesce(struct ether_notify *notify, const struct net_device_coalesce *param)
+{
+    if (param->adaptive && param->rate_low > param->rate_high) {
+        errorf("rate_low is higher than rate_high, low=%u, high=%u", param->rate_low, param->rate_high);
+        return -1;
+    }
+    notify->param = *param;
+    return 0;
+}
+
+int
+ether_notify_open(struct ether_notify *notify, struct net_device *dev, int fd, unsigned int irq)
+{
+    struct sigevent sev = {};
+
+    notify->dev = dev;
+    notify->fd = fd;
+    notify->irq = irq;
+    notify->polling = 0;
+    notify->rearmed = 0;
+    notify->sample_start = ether_notify_now();
+    notify->sample_frames = 0;
+    memset(&notify->stats, 0, sizeof(notify->stats));
+    notify->coalesce = (notify->param.adaptive || notify->param.usecs);
+    if (notify->coalesce) {
+        /* NOTE: the timer raises the same signal as the device, the ISR polls the device */
+        sev.sigev_notify = SIGEV_SIGNAL;
+        sev.sigev_signo = irq;
+        if (timer_create(CLOCK_MONOTONIC, &sev, &notify->timer) == -1) {
+            errorf("timer_create: %s, dev=%s", strerror(errno), dev->name);
+            return -1;
+        }
+    }
+    /* Set Asynchronous I/O signal delivery destination */
+    if (fcntl(fd, F_SETOWN, getpid()) == -1) {
+        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
+        ether_notify_close(notify);
+        return -1;
+    }
+    /* Use other signal instead of SIGIO */
+    if (fcntl(fd, F_SETSIG, irq) == -1) {
+        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
+        ether_notify_close(notify);
+        return -1;
+    }
+    /* Enable Asynchronous I/O */
+    if (ether_notify_arm(notify, 1) == -1) {
+        ether_notify_close(notify);
+        return -1;
+    }
+    return 0;
+}
+
+void
+ether_notify_close(struct ether_notify *notify)
+{
+    if (notify->coalesce) {
+        timer_delete(notify->timer);
+        notify->coalesce = 0;
+    }
+    notify->polling = 0;
+}
+
+/* NOTE: the signal may be shared by other devices, ignore it while the hold-off timer is running */
+int
+ether_notify_begin(struct ether_notify *notify)
+{
+    struct itimerspec its;
+
+    if (!notify->polling) {
+        return 1;
+    }
+    if (timer_gettime(notify->timer, &its) == -1) {
+        return 1;
+    }
+    return !its.it_value.tv_sec && !its.it_value.tv_nsec;
+}
+
+static void
+ether_notify_select(struct ether_notify *notify, uint32_t *usecs, uint32_t *frames)
+{
+    struct net_device_coalesce *param;
+
+    param = &notify->param;
+    if (param->adaptive && notify->stats.rate < param->rate_low) {
+        /* low rate, latency matters */
+        *usecs = 0;
+        *frames = 0;
+    } else if (param->adaptive && notify->stats.rate >= param->rate_high) {
+        *usecs = param->usecs_high;
+        *frames = param->frames_high;
+    } else {
+        *usecs = param->usecs;
+        *frames = param->frames;
+    }
+}
+
+/* NOTE: returns 1 when the device must be polled once more (the frames arrived before re-arming never notify) */
+int
+ether_notify_complete(struct ether_notify *notify, size_t frames)
+{
+    uint64_t now, elapsed;
+    uint32_t usecs, threshold;
+
+    if (notify->polling) {
+        __atomic_add_fetch(&notify->stats.polls, 1, __ATOMIC_RELAXED);
+    } else if (!notify->rearmed) {
+        __atomic_add_fetch(&notify->stats.notifications, 1, __ATOMIC_RELAXED);
+    }
+    if (!frames && !notify->rearmed) {
+        __atomic_add_fetch(&notify->stats.empty, 1, __ATOMIC_RELAXED);
+    }
+    notify->rearmed = 0;
+    __atomic_add_fetch(&notify->stats.frames, frames, __ATOMIC_RELAXED);
+    if (!notify->coalesce) {
+        return 0;
+    }
+    now = ether_notify_now();
+    notify->sample_frames += frames;
+    elapsed = now - notify->sample_start;
+    if (elapsed >= ETHER_NOTIFY_SAMPLE_INTERVAL) {
+        __atomic_store_n(&notify->stats.rate, notify->sample_frames * 1000000000 / elapsed, __ATOMIC_RELAXED);
+        notify->sample_start = now;
+        notify->sample_frames = 0;
+    }
+    ether_notify_select(notify, &usecs, &threshold);
+    if (notify->polling) {
+        if (usecs && frames >= MAX(threshold, 1)) {
+            /* still busy, keep holding off */
+            ether_notify_holdoff(notify, usecs);
+            return 0;
+        }
+        notify->polling = 0;
+        ether_notify_arm(notify, 1);
+        notify->rearmed = 1;
+        return 1;
+    }
+    if (usecs && frames) {
+        /* NOTE: the first frames are notified immediately, the following ones are coalesced */
+        if (ether_notify_arm(notify, 0) == 0) {
+            notify->polling = 1;
+            ether_notify_holdoff(notify, usecs);
+        }
+    }
+    return 0;
+}
+
+void
+ether_notify_get_stats(struct ether_notify *notify, struct net_device_coalesce_stats *stats)
+{
+    stats->notifications = __atomic_load_n(&notify->stats.notifications, __ATOMIC_RELAXED);
+    stats->polls = __atomic_load_n(&notify->stats.polls, __ATOMIC_RELAXED);
+    stats->frames = __atomic_load_n(&notify->stats.frames, __ATOMIC_RELAXED);
+    stats->empty = __atomic_load_n(&notify->stats.empty, __ATOMIC_RELAXED);
+    stats->rate = __atomic_load_n(&notify->stats.rate, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,41 @@
+#ifndef ETHER_NOTIFY_H
+#define ETHER_NOTIFY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "net.h"
+
+/*
+ * RX notification of a file descriptor (O_ASYNC with a real-time signal)
+ * with coalescing, shared by the signal-driven tap, pcap and tun devices.
+ */
+struct ether_notify {
+    struct net_device *dev;
+    int fd;
+    unsigned int irq;
+    struct net_device_coalesce param;
+    int coalesce; /* the hold-off timer is available */
+    timer_t timer;
+    int polling; /* notifications are disarmed, the timer polls the device */
+    int rearmed; /* polled once more after re-arming (not a notification) */
+    uint64_t sample_start; /* nsec */
+    uint64_t sample_frames;
+    struct net_device_coalesce_stats stats;
+};
+
+extern int
+ether_notify_set_coalesce(struct ether_notify *notify, const struct net_device_coalesce *param);
+extern int
+ether_notify_open(struct ether_notify *notify, struct net_device *dev, int fd, unsigned int irq);
+extern void
+ether_notify_close(struct ether_notify *notify);
+extern int
+ether_notify_begin(struct ether_notify *notify);
+extern int
+ether_notify_complete(struct ether_notify *notify, size_t frames);
+extern void
+ether_notify_get_stats(struct ether_notify *notify, struct net_device_coalesce_stats *stats);
+
+#endif
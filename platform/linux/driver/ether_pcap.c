@@ -1,4 +1,3 @@
-#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -21,6 +20,8 @@
 #include "ether.h"
 
 #include "driver/ether_pcap.h"
+#include "driver/ether_uring.h"
+#include "driver/ether_notify.h"
 
 #define ETHER_PCAP_IRQ (SIGRTMIN+3)
 
@@ -28,6 +29,11 @@ struct ether_pcap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    int uring_flags; /* -1: not use io_uring */
+    struct ether_uring *uring;
+    struct ether_notify notify; /* signal-driven queue only */
+    uint16_t mtu; /* 0: follow the host interface */
+    int host_mtu; /* original MTU of the host interface, 0: not changed */
 };
 
 #define PRIV(x) ((struct ether_pcap *)x->priv)
@@ -54,6 +60,43 @@ ether_pcap_addr(struct net_device *dev) {
     return 0;
 }
 
+/* NOTE: the host interface is shared with the host, give it back as it was */
+static void
+ether_pcap_restore_mtu(struct net_device *dev)
+{
+    struct ether_pcap *pcap;
+    struct ifreq ifr = {};
+
+    pcap = PRIV(dev);
+    if (!pcap->host_mtu) {
+        return;
+    }
+    strncpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_mtu = pcap->host_mtu;
+    if (ioctl(pcap->fd, SIOCSIFMTU, &ifr) == -1) {
+        errorf("ioctl(SIOCSIFMTU): %s, dev=%s", strerror(errno), dev->name);
+        return;
+    }
+    infof("restored, dev=%s, mtu=%d", dev->name, pcap->host_mtu);
+    pcap->host_mtu = 0;
+}
+
+static int
+ether_pcap_close(struct net_device *dev)
+{
+    struct ether_pcap *pcap;
+
+    pcap = PRIV(dev);
+    if (pcap->uring) {
+        ether_uring_close(pcap->uring);
+        pcap->uring = NULL;
+    }
+    ether_notify_close(&pcap->notify);
+    ether_pcap_restore_mtu(dev);
+    close(pcap->fd);
+    return 0;
+}
+
 static int
 ether_pcap_open(struct net_device *dev)
 {
@@ -62,7 +105,10 @@ ether_pcap_open(struct net_device *dev)
     struct ifreq ifr = {};
 
     pcap = PRIV(dev);
-
+    if (pcap->uring_flags != -1 && (pcap->notify.param.adaptive || pcap->notify.param.usecs)) {
+        errorf("coalescing is available only for the signal-driven queue, dev=%s", dev->name);
+        return -1;
+    }
     pcap->fd = socket(PF_PACKET, SOCK_RAW, hton16(ETH_P_ALL));
     if (pcap->fd == -1) {
         errorf("socket: %s, dev=%s", strerror(errno), dev->name);
@@ -93,51 +139,84 @@ ether_pcap_open(struct net_device *dev)
         close(pcap->fd);
         return -1;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(pcap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
+    if (ioctl(pcap->fd, SIOCGIFMTU, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFMTU): %s, dev=%s", strerror(errno), dev->name);
         close(pcap->fd);
         return -1;
     }
-    /* Enable Asynchronous I/O */
-    if (fcntl(pcap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
+    if (pcap->mtu && pcap->mtu != ifr.ifr_mtu) {
+        /* NOTE: the original MTU is restored at close */
+        pcap->host_mtu = ifr.ifr_mtu;
+        ifr.ifr_mtu = pcap->mtu;
+        if (ioctl(pcap->fd, SIOCSIFMTU, &ifr) == -1) {
+            errorf("ioctl(SIOCSIFMTU): %s, dev=%s", strerror(errno), dev->name);
+            pcap->host_mtu = 0;
+            close(pcap->fd);
+            return -1;
+        }
+    } else if (!pcap->mtu) {
+        /* NOTE: the host interface may be larger than jumbo frames (e.g. lo is 65536) */
+        if (ifr.ifr_mtu > ETHER_JUMBO_PAYLOAD_SIZE_MAX) {
+            infof("clamped, dev=%s, mtu=%d => %d", dev->name, ifr.ifr_mtu, ETHER_JUMBO_PAYLOAD_SIZE_MAX);
+            ifr.ifr_mtu = ETHER_JUMBO_PAYLOAD_SIZE_MAX;
+        }
     }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(pcap->fd, F_SETSIG, pcap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
+    /* NOTE: the buffers of io_uring are sized from the MTU */
+    if (ether_set_mtu(dev, ifr.ifr_mtu) == -1) {
+        errorf("ether_set_mtu() failure, dev=%s", dev->name);
+        ether_pcap_restore_mtu(dev);
         close(pcap->fd);
         return -1;
     }
+    if (pcap->uring_flags != -1) {
+        pcap->uring = ether_uring_open(dev, pcap->fd, pcap->uring_flags);
+        if (!pcap->uring) {
+            errorf("ether_uring_open() failure, dev=%s", dev->name);
+            ether_pcap_restore_mtu(dev);
+            close(pcap->fd);
+            return -1;
+        }
+    } else {
+        if (ether_notify_open(&pcap->notify, dev, pcap->fd, pcap->irq) == -1) {
+            errorf("ether_notify_open() failure, dev=%s", dev->name);
+            ether_pcap_restore_mtu(dev);
+            close(pcap->fd);
+            return -1;
+        }
+    }
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_pcap_addr(dev) == -1) {
             errorf("ether_pcap_addr() failure, dev=%s", dev->name);
-            close(pcap->fd);
+            ether_pcap_close(dev);
             return -1;
         }
     }
     return 0;
 };
 
-static int
-ether_pcap_close(struct net_device *dev)
+static ssize_t
+ether_pcap_sendmsg(struct net_device *dev, const struct iovec *iov, int iovcnt)
 {
-    close(PRIV(dev)->fd);
-    return 0;
+    struct msghdr msg = {};
+
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(PRIV(dev)->fd, &msg, 0);
 }
 
 static ssize_t
-ether_pcap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+ether_pcap_uring_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    return ether_uring_writev(PRIV(dev)->uring, iov, iovcnt);
 }
 
-int
-ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+static int
+ether_pcap_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
+    if (PRIV(dev)->uring) {
+        return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_pcap_uring_writev);
+    }
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_pcap_sendmsg);
 }
 
 static ssize_t
@@ -159,32 +238,43 @@ static int
 ether_pcap_isr(unsigned int irq, void *id)
 {
     struct net_device *dev = (struct net_device *)id;
+    struct ether_pcap *pcap;
     struct pollfd pfd;
+    size_t frames;
     int ret;
 
-    pfd.fd = PRIV(dev)->fd;
+    pcap = PRIV(dev);
+    if (!ether_notify_begin(&pcap->notify)) {
+        /* NOTE: holding off, the device is polled when the timer expires */
+        return 0;
+    }
+    pfd.fd = pcap->fd;
     pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
+    do {
+        frames = 0;
+        while (1) {
+            ret = poll(&pfd, 1, 0);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+                return -1;
             }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
-        }
-        if (ret == 0) {
-            break;
+            if (ret == 0) {
+                break;
+            }
+            ether_poll_helper(dev, ether_pcap_read);
+            frames++;
         }
-        ether_poll_helper(dev, ether_pcap_read);
-    }
+    } while (ether_notify_complete(&pcap->notify, frames));
     return 0;
 }
 
 static struct net_device_ops ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
-    .transmit = ether_pcap_transmit,
+    .transmit_iov = ether_pcap_transmit_iov,
 };
 
 struct net_device *
@@ -213,6 +303,7 @@ ether_pcap_init(const char *name, const char *addr)
     strncpy(pcap->name, name, sizeof(pcap->name)-1);
     pcap->fd = -1;
     pcap->irq = ETHER_PCAP_IRQ;
+    pcap->uring_flags = -1;
     dev->priv = pcap;
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
@@ -223,3 +314,63 @@ ether_pcap_init(const char *name, const char *addr)
     debugf("ethernet device initialized, dev=%s", dev->name);
     return dev;
 }
+
+/* NOTE: must not be call after net_run() */
+int
+ether_pcap_set_uring(struct net_device *dev, int sqpoll)
+{
+    if (dev->ops != &ether_pcap_ops) {
+        errorf("not a pcap device, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->uring_flags = sqpoll ? ETHER_URING_FLAG_SQPOLL : 0;
+    debugf("dev=%s, sqpoll=%s", dev->name, sqpoll ? "on" : "off");
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_pcap_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (dev->ops != &ether_pcap_ops) {
+        errorf("not a pcap device, dev=%s", dev->name);
+        return -1;
+    }
+    if (mtu < ETHER_PAYLOAD_SIZE_MIN || mtu > ETHER_JUMBO_PAYLOAD_SIZE_MAX) {
+        errorf("invalid mtu, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    /* NOTE: set on the host interface while opened (restored at close), otherwise the MTU of the host interface is used */
+    PRIV(dev)->mtu = mtu;
+    debugf("dev=%s, mtu=%u", dev->name, mtu);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_pcap_set_coalesce(struct net_device *dev, const struct net_device_coalesce *param)
+{
+    if (dev->ops != &ether_pcap_ops) {
+        errorf("not a pcap device, dev=%s", dev->name);
+        return -1;
+    }
+    if (ether_notify_set_coalesce(&PRIV(dev)->notify, param) == -1) {
+        errorf("ether_notify_set_coalesce() failure, dev=%s", dev->name);
+        return -1;
+    }
+    debugf("dev=%s, adaptive=%s, usecs=%u, frames=%u, rate_low=%u, rate_high=%u, usecs_high=%u, frames_high=%u",
+        dev->name, param->adaptive ? "on" : "off", param->usecs, param->frames,
+        param->rate_low, param->rate_high, param->usecs_high, param->frames_high);
+    return 0;
+}
+
+int
+ether_pcap_get_coalesce_stats(struct net_device *dev, struct net_device_coalesce_stats *stats)
+{
+    if (dev->ops != &ether_pcap_ops) {
+        errorf("not a pcap device, dev=%s", dev->name);
+        return -1;
+    }
+    ether_notify_get_stats(&PRIV(dev)->notify, stats);
+    return 0;
+}
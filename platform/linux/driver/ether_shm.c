@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_shm.h"
+
+#define ETHER_SHM_RING_SIZE 256 /* number of slots (power of 2) */
+
+#define ETHER_SHM_WAIT_TIMEOUT 100 /* msec */
+
+#define ETHER_SHM_CACHELINE 64
+
+/*
+ * Shared memory layout
+ *
+ *   owner[0] owner[1] | ring[0] (side 0 -> side 1) | ring[1] (side 1 -> side 0)
+ *
+ * Each ring has one producer process and one consumer process (SPSC).
+ * owner[] holds the pid of the process using the side (0: free), the side of
+ * a process that died without closing it is taken over by the next one.
+ */
+
+struct ether_shm_slot {
+    uint32_t len;
+    uint8_t data[ETHER_JUMBO_FRAME_SIZE_MAX]; /* both sides may use any MTU */
+};
+
+struct ether_shm_ring {
+    uint32_t head __attribute__((aligned(ETHER_SHM_CACHELINE))); /* consumer */
+    uint32_t sleeping; /* consumer waits for the doorbell */
+    uint32_t tail __attribute__((aligned(ETHER_SHM_CACHELINE))); /* producer */
+    uint32_t doorbell __attribute__((aligned(ETHER_SHM_CACHELINE))); /* futex word */
+    struct ether_shm_slot slots[ETHER_SHM_RING_SIZE];
+};
+
+struct ether_shm_region {
+    uint32_t owner[2]; /* pid */
+    struct ether_shm_ring rings[2];
+};
+
+struct ether_shm {
+    char name[NAME_MAX];
+    struct ether_shm_region *region;
+    int side;
+    struct ether_shm_ring *rx;
+    struct ether_shm_ring *tx;
+    mutex_t mutex; /* for TX ring (single producer per process) */
+    int running;
+    pthread_t thread;
+};
+
+#define PRIV(x) ((struct ether_shm *)x->priv)
+
+static int
+ether_shm_futex(uint32_t *addr, int op, uint32_t val, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static void
+ether_shm_doorbell(struct ether_shm_ring *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); /* publish tail before reading sleeping */
+    if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&ring->doorbell, 1, __ATOMIC_RELEASE);
+        ether_shm_futex(&ring->doorbell, FUTEX_WAKE, 1, NULL);
+    }
+}
+
+static int
+ether_shm_rx(struct net_device *dev)
+{
+    struct ether_shm_ring *ring;
+    struct ether_shm_slot *slot;
+    uint32_t head, tail;
+    int count = 0;
+
+    ring = PRIV(dev)->rx;
+    head = ring->head;
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        slot = &ring->slots[head & (ETHER_SHM_RING_SIZE - 1)];
+        /* NOTE: the peer is also microps, checksums are trusted */
+        ether_input_helper(dev, slot->data, slot->len, NET_INPUT_FLAG_CSUM_VALID);
+        count++;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+static void *
+ether_shm_thread(void *arg)
+{
+    struct net_device *dev;
+    struct ether_shm_ring *ring;
+    struct timespec timeout = {0, ETHER_SHM_WAIT_TIMEOUT * 1000 * 1000};
+    uint32_t seq;
+
+    dev = (struct net_device *)arg;
+    ring = PRIV(dev)->rx;
+    while (__atomic_load_n(&PRIV(dev)->running, __ATOMIC_ACQUIRE)) {
+        if (ether_shm_rx(dev)) {
+            continue;
+        }
+        seq = __atomic_load_n(&ring->doorbell, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == ring->head) {
+            /* NOTE: the timeout also covers a peer that died while ringing */
+            ether_shm_futex(&ring->doorbell, FUTEX_WAIT, seq, &timeout);
+        }
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int
+ether_shm_close(struct net_device *dev)
+{
+    struct ether_shm *shm;
+
+    shm = PRIV(dev);
+    if (shm->running) {
+        __atomic_store_n(&shm->running, 0, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&shm->rx->doorbell, 1, __ATOMIC_RELEASE);
+        ether_shm_futex(&shm->rx->doorbell, FUTEX_WAKE, 1, NULL);
+        pthread_join(shm->thread, NULL);
+    }
+    if (shm->region) {
+        __atomic_store_n(&shm->region->owner[shm->side], 0, __ATOMIC_RELEASE);
+        munmap(shm->region, sizeof(*shm->region));
+        shm->region = NULL;
+    }
+    return 0;
+}
+
+/*
+ * NOTE: a pid reused by another process keeps the side claimed, remove the
+ * shared memory (e.g. /dev/shm/<name>) when no stack is using it in that case
+ */
+static int
+ether_shm_claim(struct ether_shm_region *region, int side)
+{
+    uint32_t self, expected;
+
+    self = getpid();
+    expected = 0;
+    if (__atomic_compare_exchange_n(&region->owner[side], &expected, self, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    if (kill(expected, 0) == 0 || errno != ESRCH) {
+        return -1;
+    }
+    if (!__atomic_compare_exchange_n(&region->owner[side], &expected, self, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    infof("taken over from a dead process, side=%d, pid=%u", side, expected);
+    /* NOTE: the frames sent to the dead process are dropped */
+    region->rings[side ^ 1].sleeping = 0;
+    __atomic_store_n(&region->rings[side ^ 1].head, __atomic_load_n(&region->rings[side ^ 1].tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int
+ether_shm_open(struct net_device *dev)
+{
+    struct ether_shm *shm;
+    int fd, err;
+
+    shm = PRIV(dev);
+    fd = shm_open(shm->name, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        errorf("shm_open: %s, dev=%s, name=%s", strerror(errno), dev->name, shm->name);
+        return -1;
+    }
+    /* NOTE: the first one creates it (zero filled), the second one just sees the same size */
+    if (ftruncate(fd, sizeof(*shm->region)) == -1) {
+        errorf("ftruncate: %s, dev=%s", strerror(errno), dev->name);
+        close(fd);
+        return -1;
+    }
+    shm->region = mmap(NULL, sizeof(*shm->region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm->region == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        shm->region = NULL;
+        return -1;
+    }
+    for (shm->side = 0; shm->side < 2; shm->side++) {
+        if (ether_shm_claim(shm->region, shm->side) == 0) {
+            break;
+        }
+    }
+    if (shm->side == 2) {
+        errorf("already used by two stacks, dev=%s, name=%s", dev->name, shm->name);
+        munmap(shm->region, sizeof(*shm->region));
+        shm->region = NULL;
+        return -1;
+    }
+    shm->tx = &shm->region->rings[shm->side];
+    shm->rx = &shm->region->rings[shm->side ^ 1];
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        /* locally administered address, unique on this wire */
+        memset(dev->addr, 0, ETHER_ADDR_LEN);
+        dev->addr[0] = 0x02;
+        dev->addr[ETHER_ADDR_LEN-1] = shm->side + 1;
+    }
+    shm->running = 1;
+    err = pthread_create(&shm->thread, NULL, ether_shm_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        shm->running = 0;
+        ether_shm_close(dev);
+        return -1;
+    }
+    debugf("dev=%s, name=%s, side=%d", dev->name, shm->name, shm->side);
+    return 0;
+}
+
+static ssize_t
+ether_shm_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    struct ether_shm *shm;
+    struct ether_shm_ring *ring;
+    struct ether_shm_slot *slot;
+    uint32_t head, tail;
+    size_t flen;
+
+    flen = iovec_len(iov, iovcnt);
+    if (flen > sizeof(slot->data)) {
+        errorf("too long, dev=%s, len=%zu", dev->name, flen);
+        return -1;
+    }
+    shm = PRIV(dev);
+    ring = shm->tx;
+    mutex_lock(&shm->mutex);
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    if (tail - head == ETHER_SHM_RING_SIZE) {
+        mutex_unlock(&shm->mutex);
+        errorf("ring is full, dev=%s", dev->name);
+        return -1;
+    }
+    slot = &ring->slots[tail & (ETHER_SHM_RING_SIZE - 1)];
+    /* NOTE: the fragments are gathered right into the slot */
+    iovec_gather(slot->data, flen, iov, iovcnt);
+    slot->len = flen;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    ether_shm_doorbell(ring);
+    mutex_unlock(&shm->mutex);
+    return flen;
+}
+
+int
+ether_shm_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_shm_writev);
+}
+
+static struct net_device_ops ether_shm_ops = {
+    .open = ether_shm_open,
+    .close = ether_shm_close,
+    .transmit_iov = ether_shm_transmit_iov,
+};
+
+static void
+ether_shm_setup(struct net_device *dev)
+{
+    ether_setup_helper(dev);
+    /* NOTE: frames never leave the host */
+    dev->features = NET_DEVICE_FEATURE_CSUM_TX | NET_DEVICE_FEATURE_CSUM_RX;
+}
+
+struct net_device *
+ether_shm_init(const char *name, const char *addr)
+{
+    struct net_device *dev;
+    struct ether_shm *shm;
+
+    dev = net_device_alloc(ether_shm_setup);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_shm_ops;
+    shm = memory_alloc(sizeof(*shm));
+    if (!shm) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    snprintf(shm->name, sizeof(shm->name), "%s%s", name[0] == '/' ? "" : "/", name);
+    mutex_init(&shm->mutex);
+    dev->priv = shm;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(shm);
+        return NULL;
+    }
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
@@ -1,4 +1,3 @@
-#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -10,25 +9,50 @@
 #include <sys/socket.h>
 #include <sys/ioctl.h>
 #include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
 #include "ether.h"
+#include "ip.h"
+#include "capture.h"
 
 #include "driver/ether_tap.h"
+#include "driver/ether_uring.h"
+#include "driver/ether_notify.h"
 
 #define CLONE_DEVICE "/dev/net/tun"
 
 #define ETHER_TAP_IRQ (SIGRTMIN+2)
 
+#define ETHER_TAP_BUF_SIZE (ETHER_HDR_SIZE + IP_TOTAL_SIZE_MAX) /* coalesced by the kernel (GRO) */
+#define ETHER_TAP_PEEK_SIZE 128 /* IP and TCP headers (with options) */
+
+struct ether_tap_queue {
+    struct net_device *dev;
+    int fd;
+    pthread_t thread;
+    uint8_t *buf; /* NOTE: allocated only when offload is enabled */
+};
+
 struct ether_tap {
     char name[IFNAMSIZ];
-    int fd;
+    int fd; /* NOTE: alias of queues[0].fd */
     unsigned int irq;
+    unsigned int num; /* number of queues */
+    int offload; /* use virtio-net header (IFF_VNET_HDR) */
+    uint16_t mtu; /* 0: follow the host interface */
+    int uring_flags; /* -1: not use io_uring */
+    struct ether_uring *uring;
+    struct ether_notify notify; /* signal-driven queue only */
+    struct ether_tap_queue queues[ETHER_TAP_QUEUE_MAX];
+    int event; /* eventfd to stop the queue threads */
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
@@ -56,116 +80,461 @@ ether_tap_addr(struct net_device *dev) {
 }
 
 static int
-ether_tap_open(struct net_device *dev)
+ether_tap_mtu(struct net_device *dev)
+{
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (PRIV(dev)->mtu) {
+        ifr.ifr_mtu = PRIV(dev)->mtu;
+        if (ioctl(soc, SIOCSIFMTU, &ifr) == -1) {
+            errorf("ioctl(SIOCSIFMTU): %s, dev=%s", strerror(errno), dev->name);
+            close(soc);
+            return -1;
+        }
+    } else {
+        if (ioctl(soc, SIOCGIFMTU, &ifr) == -1) {
+            errorf("ioctl(SIOCGIFMTU): %s, dev=%s", strerror(errno), dev->name);
+            close(soc);
+            return -1;
+        }
+        /* NOTE: the host interface may be larger than jumbo frames (e.g. lo is 65536) */
+        if (ifr.ifr_mtu > ETHER_JUMBO_PAYLOAD_SIZE_MAX) {
+            infof("clamped, dev=%s, mtu=%d => %d", dev->name, ifr.ifr_mtu, ETHER_JUMBO_PAYLOAD_SIZE_MAX);
+            ifr.ifr_mtu = ETHER_JUMBO_PAYLOAD_SIZE_MAX;
+        }
+    }
+    close(soc);
+    return ether_set_mtu(dev, ifr.ifr_mtu);
+}
+
+static int
+ether_tap_queue_open(struct net_device *dev, struct ether_tap_queue *queue)
 {
     struct ether_tap *tap;
     struct ifreq ifr = {};
 
     tap = PRIV(dev);
-    tap->fd = open(CLONE_DEVICE, O_RDWR);
-    if (tap->fd == -1) {
+    queue->dev = dev;
+    queue->fd = open(CLONE_DEVICE, O_RDWR);
+    if (queue->fd == -1) {
         errorf("open: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
     strncpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name)-1);
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-    if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
+    if (tap->num > 1) {
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+    }
+    if (tap->offload) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
+    if (ioctl(queue->fd, TUNSETIFF, &ifr) == -1) {
         errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+        close(queue->fd);
+        return -1;
+    }
+    /* NOTE: the interface exists once the first queue is attached, the buffers of io_uring are sized from the MTU */
+    if (queue == &tap->queues[0] && ether_tap_mtu(dev) == -1) {
+        errorf("ether_tap_mtu() failure, dev=%s", dev->name);
+        close(queue->fd);
+        return -1;
+    }
+    /* NOTE: reset it also when disabled, a persistent tap keeps the last setting */
+    /* NOTE: TUN_F_UFO is not requested (no IP fragmentation in this stack) */
+    if (ioctl(queue->fd, TUNSETOFFLOAD, tap->offload ? (TUN_F_CSUM | TUN_F_TSO4) : 0) == -1) {
+        errorf("ioctl(TUNSETOFFLOAD): %s, dev=%s", strerror(errno), dev->name);
+        close(queue->fd);
+        return -1;
+    }
+    if (tap->offload) {
+        queue->buf = memory_alloc(ETHER_TAP_BUF_SIZE);
+        if (!queue->buf) {
+            errorf("memory_alloc() failure, dev=%s", dev->name);
+            close(queue->fd);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+ether_tap_queue_close(struct ether_tap_queue *queue)
+{
+    close(queue->fd);
+    if (queue->buf) {
+        memory_free(queue->buf);
+        queue->buf = NULL;
+    }
+}
+
+static int
+ether_tap_queue_input(struct net_device *dev, struct ether_tap_queue *queue)
+{
+    struct virtio_net_hdr vnet;
+    struct iovec iov[2];
+    uint8_t frame[ETHER_JUMBO_FRAME_SIZE_MAX];
+    ssize_t len;
+    int flags = 0;
+
+    if (!queue->buf) {
+        len = read(queue->fd, frame, dev->hlen + dev->mtu);
+        if (len == -1) {
+            if (errno != EINTR && errno != EAGAIN) {
+                errorf("read: %s, dev=%s", strerror(errno), dev->name);
+            }
+            return -1;
+        }
+        return ether_input_helper(dev, frame, len, 0);
+    }
+    iov[0].iov_base = &vnet;
+    iov[0].iov_len = sizeof(vnet);
+    iov[1].iov_base = queue->buf;
+    iov[1].iov_len = ETHER_TAP_BUF_SIZE;
+    len = readv(queue->fd, iov, countof(iov));
+    if (len == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            errorf("readv: %s, dev=%s", strerror(errno), dev->name);
+        }
         return -1;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(tap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+    if ((size_t)len < sizeof(vnet)) {
+        errorf("too short, dev=%s, len=%zd", dev->name, len);
         return -1;
     }
-    /* Enable Asynchronous I/O */
-    if (fcntl(tap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+    if (vnet.flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        /* NOTE: NEEDS_CSUM is a packet from the host which never crossed the wire */
+        flags |= NET_INPUT_FLAG_CSUM_VALID;
+    }
+    return ether_input_helper(dev, queue->buf, len - sizeof(vnet), flags);
+}
+
+static void *
+ether_tap_queue_thread(void *arg)
+{
+    struct ether_tap_queue *queue;
+    struct net_device *dev;
+    struct pollfd pfds[2];
+
+    queue = (struct ether_tap_queue *)arg;
+    dev = queue->dev;
+    pfds[0].fd = queue->fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = PRIV(dev)->event;
+    pfds[1].events = POLLIN;
+    while (1) {
+        if (poll(pfds, countof(pfds), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            ether_tap_queue_input(dev, queue);
+        }
+    }
+    return NULL;
+}
+
+static int
+ether_tap_open_mq(struct net_device *dev)
+{
+    struct ether_tap *tap;
+    unsigned int i;
+    int err;
+
+    tap = PRIV(dev);
+    tap->event = eventfd(0, 0);
+    if (tap->event == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    for (i = 0; i < tap->num; i++) {
+        if (ether_tap_queue_open(dev, &tap->queues[i]) == -1) {
+            errorf("ether_tap_queue_open() failure, dev=%s, queue=%u", dev->name, i);
+            break;
+        }
+        err = pthread_create(&tap->queues[i].thread, NULL, ether_tap_queue_thread, &tap->queues[i]);
+        if (err) {
+            errorf("pthread_create() %s, dev=%s, queue=%u", strerror(err), dev->name, i);
+            ether_tap_queue_close(&tap->queues[i]);
+            break;
+        }
+    }
+    if (i != tap->num) {
+        eventfd_write(tap->event, 1);
+        while (i--) {
+            pthread_join(tap->queues[i].thread, NULL);
+            ether_tap_queue_close(&tap->queues[i]);
+        }
+        close(tap->event);
+        return -1;
+    }
+    tap->fd = tap->queues[0].fd;
+    debugf("dev=%s, queues=%u", dev->name, tap->num);
+    return 0;
+}
+
+static int
+ether_tap_close(struct net_device *dev)
+{
+    struct ether_tap *tap;
+    unsigned int i;
+
+    tap = PRIV(dev);
+    if (tap->num > 1) {
+        eventfd_write(tap->event, 1);
+        for (i = 0; i < tap->num; i++) {
+            pthread_join(tap->queues[i].thread, NULL);
+            ether_tap_queue_close(&tap->queues[i]);
+        }
+        close(tap->event);
+        return 0;
+    }
+    if (tap->uring) {
+        ether_uring_close(tap->uring);
+        tap->uring = NULL;
+    }
+    ether_notify_close(&tap->notify);
+    ether_tap_queue_close(&tap->queues[0]);
+    return 0;
+}
+
+static int
+ether_tap_open(struct net_device *dev)
+{
+    struct ether_tap *tap;
+
+    tap = PRIV(dev);
+    if (tap->uring_flags != -1 && (tap->num > 1 || tap->offload)) {
+        errorf("io_uring supports neither multiple queues nor offload, dev=%s", dev->name);
         return -1;
     }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(tap->fd, F_SETSIG, tap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
+    if ((tap->num > 1 || tap->uring_flags != -1) && (tap->notify.param.adaptive || tap->notify.param.usecs)) {
+        errorf("coalescing is available only for the signal-driven queue, dev=%s", dev->name);
         return -1;
     }
+    if (tap->num > 1) {
+        if (ether_tap_open_mq(dev) == -1) {
+            return -1;
+        }
+    } else if (tap->uring_flags != -1) {
+        if (ether_tap_queue_open(dev, &tap->queues[0]) == -1) {
+            return -1;
+        }
+        tap->fd = tap->queues[0].fd;
+        tap->uring = ether_uring_open(dev, tap->fd, tap->uring_flags);
+        if (!tap->uring) {
+            errorf("ether_uring_open() failure, dev=%s", dev->name);
+            ether_tap_queue_close(&tap->queues[0]);
+            return -1;
+        }
+    } else {
+        if (ether_tap_queue_open(dev, &tap->queues[0]) == -1) {
+            return -1;
+        }
+        tap->fd = tap->queues[0].fd;
+        if (ether_notify_open(&tap->notify, dev, tap->fd, tap->irq) == -1) {
+            errorf("ether_notify_open() failure, dev=%s", dev->name);
+            ether_tap_queue_close(&tap->queues[0]);
+            return -1;
+        }
+    }
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_tap_addr(dev) == -1) {
             errorf("ether_tap_addr() failure, dev=%s", dev->name);
-            close(tap->fd);
+            ether_tap_close(dev);
             return -1;
         }
     }
     return 0;
 };
 
-static int
-ether_tap_close(struct net_device *dev)
+/* NOTE: keep a flow on the same queue to avoid reordering (hash of IPv4 addresses and ports) */
+static struct ether_tap_queue *
+ether_tap_select_queue(struct ether_tap *tap, uint16_t type, const uint8_t *ip, size_t len)
 {
-    close(PRIV(dev)->fd);
-    return 0;
+    uint32_t hash;
+    size_t hlen;
+
+    if (tap->num == 1 || type != ETHER_TYPE_IP || len < IP_HDR_SIZE_MIN) {
+        return &tap->queues[0];
+    }
+    hash = (ip[12] << 24 | ip[13] << 16 | ip[14] << 8 | ip[15]) ^ (ip[16] << 24 | ip[17] << 16 | ip[18] << 8 | ip[19]);
+    hlen = (ip[0] & 0x0f) << 2;
+    if ((ip[9] == IP_PROTOCOL_TCP || ip[9] == IP_PROTOCOL_UDP) && !(ip[6] & 0x3f) && !ip[7] && len >= hlen + 4) {
+        /* TCP or UDP (not fragmented) */
+        hash ^= ip[hlen] << 24 | ip[hlen+1] << 16 | ip[hlen+2] << 8 | ip[hlen+3];
+    }
+    hash ^= hash >> 16;
+    hash *= 0x45d9f3b;
+    hash ^= hash >> 16;
+    return &tap->queues[hash % tap->num];
 }
 
+/* NOTE: the headers may span the fragments, peek them only when there is a choice of queues */
 static ssize_t
-ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+ether_tap_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    struct ether_tap *tap;
+    struct ether_tap_queue *queue;
+    uint8_t peek[ETHER_HDR_SIZE + ETHER_TAP_PEEK_SIZE];
+    size_t len;
+
+    tap = PRIV(dev);
+    queue = &tap->queues[0];
+    if (tap->num > 1) {
+        len = iovec_gather(peek, sizeof(peek), iov, iovcnt);
+        queue = ether_tap_select_queue(tap, peek[12] << 8 | peek[13], peek + ETHER_HDR_SIZE, len - ETHER_HDR_SIZE);
+    }
+    return writev(queue->fd, iov, iovcnt);
 }
 
-int
-ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+/* NOTE: the checksum field already holds the pseudo header sum (partial checksum) */
+static void
+ether_tap_vnet_hdr(struct net_device *dev, struct virtio_net_hdr *vnet, const uint8_t *ip, size_t size, size_t len)
+{
+    size_t hlen, thlen;
+
+    hlen = (ip[0] & 0x0f) << 2;
+    if (size < hlen + 8 || (ip[6] & 0x3f) || ip[7]) {
+        /* fragmented */
+        return;
+    }
+    switch (ip[9]) {
+    case IP_PROTOCOL_TCP:
+        vnet->csum_offset = 16;
+        break;
+    case IP_PROTOCOL_UDP:
+        vnet->csum_offset = 6;
+        break;
+    default:
+        return;
+    }
+    vnet->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vnet->csum_start = ETHER_HDR_SIZE + hlen;
+    if (ip[9] == IP_PROTOCOL_TCP && len > dev->mtu) {
+        thlen = (ip[hlen+12] >> 4) << 2;
+        vnet->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vnet->gso_size = dev->mtu - (hlen + thlen);
+        vnet->hdr_len = ETHER_HDR_SIZE + hlen + thlen;
+    }
+}
+
+static int
+ether_tap_transmit_vnet(struct net_device *dev, uint16_t type, const struct iovec *data, int datacnt, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+    static const uint8_t pad[ETHER_PAYLOAD_SIZE_MIN];
+    struct virtio_net_hdr vnet = {};
+    uint8_t hdr[ETHER_HDR_SIZE];
+    uint8_t peek[ETHER_TAP_PEEK_SIZE];
+    struct iovec iov[2 + NET_DEVICE_IOV_MAX + 1];
+    int iovcnt = 0;
+    size_t len, size = 0;
+
+    if (datacnt > NET_DEVICE_IOV_MAX) {
+        errorf("too many fragments, dev=%s, iovcnt=%d", dev->name, datacnt);
+        return -1;
+    }
+    len = iovec_len(data, datacnt);
+    memcpy(hdr, dst, ETHER_ADDR_LEN);
+    memcpy(hdr + ETHER_ADDR_LEN, dev->addr, ETHER_ADDR_LEN);
+    hdr[12] = type >> 8;
+    hdr[13] = type & 0xff;
+    if (type == ETHER_TYPE_IP && len >= IP_HDR_SIZE_MIN) {
+        size = iovec_gather(peek, sizeof(peek), data, datacnt);
+        ether_tap_vnet_hdr(dev, &vnet, peek, size, len);
+    }
+    iov[iovcnt].iov_base = &vnet;
+    iov[iovcnt++].iov_len = sizeof(vnet);
+    iov[iovcnt].iov_base = hdr;
+    iov[iovcnt++].iov_len = sizeof(hdr);
+    memcpy(&iov[iovcnt], data, sizeof(*data) * datacnt);
+    iovcnt += datacnt;
+    if (len < ETHER_PAYLOAD_SIZE_MIN) {
+        iov[iovcnt].iov_base = (void *)pad;
+        iov[iovcnt++].iov_len = ETHER_PAYLOAD_SIZE_MIN - len;
+    }
+    debugf("dev=%s, type=0x%04x, len=%zu, gso_size=%u", dev->name, type, len, vnet.gso_size);
+    if (CAPTURE_ENABLED(dev)) {
+        capture_frame_iov(dev, iov + 1, iovcnt - 1);
+    }
+    if (writev(ether_tap_select_queue(PRIV(dev), type, peek, size)->fd, iov, iovcnt) == -1) {
+        errorf("writev: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
 }
 
 static ssize_t
-ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
+ether_tap_uring_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
 {
-    ssize_t len;
+    return ether_uring_writev(PRIV(dev)->uring, iov, iovcnt);
+}
 
-    len = read(PRIV(dev)->fd, buf, size);
-    if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
-        }
-        return -1;
+static int
+ether_tap_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    if (PRIV(dev)->offload) {
+        return ether_tap_transmit_vnet(dev, type, iov, iovcnt, dst);
+    }
+    if (PRIV(dev)->uring) {
+        return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_tap_uring_writev);
     }
-    return len;
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_tap_writev);
 }
 
 static int
 ether_tap_isr(unsigned int irq, void *id)
 {
     struct net_device *dev = (struct net_device *)id;
+    struct ether_tap *tap;
     struct pollfd pfd;
+    size_t frames;
     int ret;
 
-    pfd.fd = PRIV(dev)->fd;
+    tap = PRIV(dev);
+    if (!ether_notify_begin(&tap->notify)) {
+        /* NOTE: holding off, the device is polled when the timer expires */
+        return 0;
+    }
+    pfd.fd = tap->fd;
     pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
+    do {
+        frames = 0;
+        while (1) {
+            ret = poll(&pfd, 1, 0);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+                return -1;
             }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
-        }
-        if (ret == 0) {
-            break;
+            if (ret == 0) {
+                break;
+            }
+            ether_tap_queue_input(dev, &tap->queues[0]);
+            frames++;
         }
-        ether_poll_helper(dev, ether_tap_read);
-    }
+    } while (ether_notify_complete(&tap->notify, frames));
     return 0;
 }
 
 static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
-    .transmit = ether_tap_transmit,
+    .transmit_iov = ether_tap_transmit_iov,
 };
 
 struct net_device *
@@ -194,6 +563,8 @@ ether_tap_init(const char *name, const char *addr)
     strncpy(tap->name, name, sizeof(tap->name)-1);
     tap->fd = -1;
     tap->irq = ETHER_TAP_IRQ;
+    tap->num = 1;
+    tap->uring_flags = -1;
     dev->priv = tap;
     if (net_device_register(dev) == -1) {
         errorf("net_device_register() failure");
@@ -204,3 +575,100 @@ ether_tap_init(const char *name, const char *addr)
     debugf("ethernet device initialized, dev=%s", dev->name);
     return dev;
 }
+
+/* NOTE: must not be call after net_run() */
+int
+ether_tap_set_queues(struct net_device *dev, unsigned int num)
+{
+    if (dev->ops != &ether_tap_ops) {
+        errorf("not a tap device, dev=%s", dev->name);
+        return -1;
+    }
+    if (!num || num > ETHER_TAP_QUEUE_MAX) {
+        errorf("invalid number of queues, dev=%s, num=%u", dev->name, num);
+        return -1;
+    }
+    PRIV(dev)->num = num;
+    debugf("dev=%s, queues=%u", dev->name, num);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_tap_set_offload(struct net_device *dev, int enable)
+{
+    if (dev->ops != &ether_tap_ops) {
+        errorf("not a tap device, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->offload = enable ? 1 : 0;
+    if (enable) {
+        dev->features |= (NET_DEVICE_FEATURE_CSUM_TX | NET_DEVICE_FEATURE_CSUM_RX | NET_DEVICE_FEATURE_TSO);
+        dev->gso_max_size = NET_DEVICE_GSO_MAX_SIZE;
+    } else {
+        dev->features &= ~(NET_DEVICE_FEATURE_CSUM_TX | NET_DEVICE_FEATURE_CSUM_RX | NET_DEVICE_FEATURE_TSO);
+        dev->gso_max_size = 0;
+    }
+    debugf("dev=%s, offload=%s", dev->name, enable ? "on" : "off");
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_tap_set_uring(struct net_device *dev, int sqpoll)
+{
+    if (dev->ops != &ether_tap_ops) {
+        errorf("not a tap device, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->uring_flags = sqpoll ? ETHER_URING_FLAG_SQPOLL : 0;
+    debugf("dev=%s, sqpoll=%s", dev->name, sqpoll ? "on" : "off");
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_tap_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (dev->ops != &ether_tap_ops) {
+        errorf("not a tap device, dev=%s", dev->name);
+        return -1;
+    }
+    if (mtu < ETHER_PAYLOAD_SIZE_MIN || mtu > ETHER_JUMBO_PAYLOAD_SIZE_MAX) {
+        errorf("invalid mtu, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    /* NOTE: set on the host interface at open, otherwise the MTU of the host interface is used */
+    PRIV(dev)->mtu = mtu;
+    debugf("dev=%s, mtu=%u", dev->name, mtu);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_tap_set_coalesce(struct net_device *dev, const struct net_device_coalesce *param)
+{
+    if (dev->ops != &ether_tap_ops) {
+        errorf("not a tap device, dev=%s", dev->name);
+        return -1;
+    }
+    if (ether_notify_set_coalesce(&PRIV(dev)->notify, param) == -1) {
+        errorf("ether_notify_set_coalesce() failure, dev=%s", dev->name);
+        return -1;
+    }
+    debugf("dev=%s, adaptive=%s, usecs=%u, frames=%u, rate_low=%u, rate_high=%u, usecs_high=%u, frames_high=%u",
+        dev->name, param->adaptive ? "on" : "off", param->usecs, param->frames,
+        param->rate_low, param->rate_high, param->usecs_high, param->frames_high);
+    return 0;
+}
+
+int
+ether_tap_get_coalesce_stats(struct net_device *dev, struct net_device_coalesce_stats *stats)
+{
+    if (dev->ops != &ether_tap_ops) {
+        errorf("not a tap device, dev=%s", dev->name);
+        return -1;
+    }
+    ether_notify_get_stats(&PRIV(dev)->notify, stats);
+    return 0;
+}
@@ -0,0 +1,443 @@
+#define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_udp.h"
+#include "driver/ether_notify.h"
+
+#define ETHER_UDP_IRQ (SIGRTMIN+5)
+
+#define ETHER_UDP_GSO_SEGS_MAX 64    /* UDP_MAX_SEGMENTS of Linux */
+#define ETHER_UDP_PAYLOAD_MAX  65507 /* maximum payload of UDP over IPv4 */
+
+struct ether_udp_entry {
+    size_t len;
+    uint8_t data[];
+};
+
+/*
+ * Ethernet frames in UDP datagrams exchanged with a single peer (like a
+ * minimal VXLAN without a header). RX is signal-driven and drained with
+ * recvmmsg(), TX frames are queued and flushed by a thread with sendmmsg().
+ */
+struct ether_udp {
+    struct sockaddr_in local;
+    struct sockaddr_in peer;
+    int fd;
+    unsigned int irq;
+    int offload; /* UDP GSO/GRO */
+    struct ether_notify notify;
+    uint8_t *bufs; /* RX buffers (ETHER_UDP_BATCH * bufsiz) */
+    size_t bufsiz;
+    struct queue_head queue; /* TX frames */
+    size_t drops;
+    mutex_t mutex; /* for queue and drops */
+    pthread_cond_t cond;
+    int running;
+    pthread_t thread;
+};
+
+#define PRIV(x) ((struct ether_udp *)x->priv)
+
+static int
+ether_udp_endpoint_pton(const char *p, struct sockaddr_in *n)
+{
+    char addr[INET_ADDRSTRLEN];
+    const char *sep;
+    char *end;
+    long port;
+
+    sep = strrchr(p, ':');
+    if (!sep || (size_t)(sep - p) >= sizeof(addr)) {
+        return -1;
+    }
+    memcpy(addr, p, sep - p);
+    addr[sep - p] = '\0';
+    port = strtol(sep + 1, &end, 10);
+    if (*end || port <= 0 || port > UINT16_MAX) {
+        return -1;
+    }
+    memset(n, 0, sizeof(*n));
+    n->sin_family = AF_INET;
+    n->sin_port = htons(port);
+    return inet_pton(AF_INET, addr, &n->sin_addr) == 1 ? 0 : -1;
+}
+
+/* NOTE: runs of the same size (the segments of GSO/TSO) are sent as one datagram with UDP_SEGMENT */
+static void
+ether_udp_flush(struct net_device *dev, struct ether_udp_entry **entries, size_t num)
+{
+    struct ether_udp *udp;
+    struct mmsghdr msgs[ETHER_UDP_BATCH] = {};
+    struct iovec iov[ETHER_UDP_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr align;
+    } cmsgs[ETHER_UDP_BATCH];
+    struct cmsghdr *cmsg;
+    size_t i, j, total;
+    unsigned int n = 0, sent = 0;
+    int ret;
+
+    udp = PRIV(dev);
+    for (i = 0; i < num; i = j) {
+        iov[i].iov_base = entries[i]->data;
+        iov[i].iov_len = entries[i]->len;
+        total = entries[i]->len;
+        j = i + 1;
+        if (udp->offload) {
+            while (j < num && j - i < ETHER_UDP_GSO_SEGS_MAX && entries[j]->len <= entries[i]->len && total + entries[j]->len <= ETHER_UDP_PAYLOAD_MAX) {
+                iov[j].iov_base = entries[j]->data;
+                iov[j].iov_len = entries[j]->len;
+                total += entries[j++]->len;
+                if (entries[j-1]->len < entries[i]->len) {
+                    /* only the last segment may be shorter */
+                    break;
+                }
+            }
+        }
+        msgs[n].msg_hdr.msg_iov = &iov[i];
+        msgs[n].msg_hdr.msg_iovlen = j - i;
+        if (j - i > 1) {
+            msgs[n].msg_hdr.msg_control = cmsgs[n].buf;
+            msgs[n].msg_hdr.msg_controllen = sizeof(cmsgs[n].buf);
+            cmsg = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cmsg) = entries[i]->len;
+        }
+        n++;
+    }
+    while (sent < n) {
+        ret = sendmmsg(udp->fd, msgs + sent, n - sent, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("sendmmsg: %s, dev=%s", strerror(errno), dev->name);
+            return;
+        }
+        sent += ret;
+    }
+    debugf("dev=%s, frames=%zu, datagrams=%u", dev->name, num, n);
+}
+
+static void *
+ether_udp_thread(void *arg)
+{
+    struct net_device *dev;
+    struct ether_udp *udp;
+    struct ether_udp_entry *entries[ETHER_UDP_BATCH];
+    size_t num, i;
+
+    dev = (struct net_device *)arg;
+    udp = PRIV(dev);
+    mutex_lock(&udp->mutex);
+    while (1) {
+        if (!udp->queue.num) {
+            if (!udp->running) {
+                break;
+            }
+            pthread_cond_wait(&udp->cond, &udp->mutex);
+            continue;
+        }
+        /* NOTE: the frames queued while the previous batch was being sent go out at once */
+        for (num = 0; num < ETHER_UDP_BATCH && udp->queue.num; num++) {
+            entries[num] = queue_pop(&udp->queue);
+        }
+        mutex_unlock(&udp->mutex);
+        ether_udp_flush(dev, entries, num);
+        for (i = 0; i < num; i++) {
+            memory_free(entries[i]);
+        }
+        mutex_lock(&udp->mutex);
+    }
+    mutex_unlock(&udp->mutex);
+    return NULL;
+}
+
+static int
+ether_udp_close(struct net_device *dev)
+{
+    struct ether_udp *udp;
+
+    udp = PRIV(dev);
+    mutex_lock(&udp->mutex);
+    udp->running = 0;
+    pthread_cond_signal(&udp->cond);
+    mutex_unlock(&udp->mutex);
+    pthread_join(udp->thread, NULL);
+    ether_notify_close(&udp->notify);
+    close(udp->fd);
+    memory_free(udp->bufs);
+    udp->bufs = NULL;
+    infof("dev=%s, drops=%zu", dev->name, udp->drops);
+    return 0;
+}
+
+static int
+ether_udp_open(struct net_device *dev)
+{
+    struct ether_udp *udp;
+    int opt = 1, err;
+
+    udp = PRIV(dev);
+    udp->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp->fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (bind(udp->fd, (struct sockaddr *)&udp->local, sizeof(udp->local)) == -1) {
+        errorf("bind: %s, dev=%s", strerror(errno), dev->name);
+        close(udp->fd);
+        return -1;
+    }
+    /* NOTE: the kernel drops the datagrams from other than the peer */
+    if (connect(udp->fd, (struct sockaddr *)&udp->peer, sizeof(udp->peer)) == -1) {
+        errorf("connect: %s, dev=%s", strerror(errno), dev->name);
+        close(udp->fd);
+        return -1;
+    }
+    if (udp->offload && setsockopt(udp->fd, SOL_UDP, UDP_GRO, &opt, sizeof(opt)) == -1) {
+        errorf("setsockopt(UDP_GRO): %s, dev=%s", strerror(errno), dev->name);
+        close(udp->fd);
+        return -1;
+    }
+    /* NOTE: a datagram coalesced by GRO carries several frames */
+    udp->bufsiz = udp->offload ? ETHER_UDP_PAYLOAD_MAX : (size_t)(dev->hlen + dev->mtu);
+    udp->bufs = memory_alloc(ETHER_UDP_BATCH * udp->bufsiz);
+    if (!udp->bufs) {
+        errorf("memory_alloc() failure, dev=%s", dev->name);
+        close(udp->fd);
+        return -1;
+    }
+    if (ether_notify_open(&udp->notify, dev, udp->fd, udp->irq) == -1) {
+        errorf("ether_notify_open() failure, dev=%s", dev->name);
+        memory_free(udp->bufs);
+        close(udp->fd);
+        return -1;
+    }
+    udp->running = 1;
+    err = pthread_create(&udp->thread, NULL, ether_udp_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        udp->running = 0;
+        ether_notify_close(&udp->notify);
+        memory_free(udp->bufs);
+        close(udp->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t
+ether_udp_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    struct ether_udp *udp;
+    struct ether_udp_entry *entry;
+    size_t len;
+
+    udp = PRIV(dev);
+    len = iovec_len(iov, iovcnt);
+    entry = memory_alloc(sizeof(*entry) + len);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->len = iovec_gather(entry->data, len, iov, iovcnt);
+    mutex_lock(&udp->mutex);
+    if (udp->queue.num >= ETHER_UDP_QUEUE_LIMIT || !queue_push(&udp->queue, entry)) {
+        udp->drops++;
+        mutex_unlock(&udp->mutex);
+        memory_free(entry);
+        return -1;
+    }
+    pthread_cond_signal(&udp->cond);
+    mutex_unlock(&udp->mutex);
+    return len;
+}
+
+static int
+ether_udp_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_udp_writev);
+}
+
+static size_t
+ether_udp_input(struct net_device *dev, uint8_t *buf, size_t len, struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg;
+    size_t size, off, frames = 0;
+
+    size = len;
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            size = *(int *)CMSG_DATA(cmsg);
+        }
+    }
+    for (off = 0; off < len; off += size) {
+        ether_input_helper(dev, buf + off, MIN(size, len - off), 0);
+        frames++;
+    }
+    return frames;
+}
+
+static size_t
+ether_udp_poll(struct net_device *dev)
+{
+    struct ether_udp *udp;
+    struct mmsghdr msgs[ETHER_UDP_BATCH];
+    struct iovec iov[ETHER_UDP_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } cmsgs[ETHER_UDP_BATCH];
+    size_t frames = 0;
+    int ret, i;
+
+    udp = PRIV(dev);
+    while (1) {
+        memset(msgs, 0, sizeof(msgs));
+        for (i = 0; i < ETHER_UDP_BATCH; i++) {
+            iov[i].iov_base = udp->bufs + i * udp->bufsiz;
+            iov[i].iov_len = udp->bufsiz;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = cmsgs[i].buf;
+            msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i].buf);
+        }
+        ret = recvmmsg(udp->fd, msgs, ETHER_UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                errorf("recvmmsg: %s, dev=%s", strerror(errno), dev->name);
+            }
+            break;
+        }
+        for (i = 0; i < ret; i++) {
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                errorf("too long, dev=%s, len=%u", dev->name, msgs[i].msg_len);
+                continue;
+            }
+            frames += ether_udp_input(dev, iov[i].iov_base, msgs[i].msg_len, &msgs[i].msg_hdr);
+        }
+        if (ret < ETHER_UDP_BATCH) {
+            break;
+        }
+    }
+    return frames;
+}
+
+static int
+ether_udp_isr(unsigned int irq, void *id)
+{
+    struct net_device *dev = (struct net_device *)id;
+    struct ether_udp *udp;
+
+    udp = PRIV(dev);
+    if (!ether_notify_begin(&udp->notify)) {
+        return 0;
+    }
+    while (ether_notify_complete(&udp->notify, ether_udp_poll(dev)));
+    return 0;
+}
+
+static struct net_device_ops ether_udp_ops = {
+    .open = ether_udp_open,
+    .close = ether_udp_close,
+    .transmit_iov = ether_udp_transmit_iov,
+};
+
+struct net_device *
+ether_udp_init(const char *addr, const char *local, const char *peer)
+{
+    struct net_device *dev;
+    struct ether_udp *udp;
+    uint8_t *ip;
+    uint16_t port;
+
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_udp_ops;
+    udp = memory_alloc(sizeof(*udp));
+    if (!udp) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    if (ether_udp_endpoint_pton(local, &udp->local) == -1) {
+        errorf("invalid endpoint, local=%s", local);
+        memory_free(udp);
+        return NULL;
+    }
+    if (ether_udp_endpoint_pton(peer, &udp->peer) == -1) {
+        errorf("invalid endpoint, peer=%s", peer);
+        memory_free(udp);
+        return NULL;
+    }
+    udp->fd = -1;
+    udp->irq = ETHER_UDP_IRQ;
+    queue_init(&udp->queue);
+    mutex_init(&udp->mutex);
+    pthread_cond_init(&udp->cond, NULL);
+    dev->priv = udp;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(udp);
+        return NULL;
+    }
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        /* locally administered address, derived from the local endpoint (unique among the processes) */
+        ip = (uint8_t *)&udp->local.sin_addr;
+        port = ntohs(udp->local.sin_port);
+        dev->addr[0] = 0x02;
+        dev->addr[1] = port >> 8;
+        dev->addr[2] = port & 0xff;
+        memcpy(dev->addr + 3, ip + 1, 3);
+    }
+    intr_request_irq(udp->irq, ether_udp_isr, NET_IRQ_SHARED, dev->name, dev);
+    debugf("ethernet device initialized, dev=%s, local=%s, peer=%s", dev->name, local, peer);
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_udp_set_offload(struct net_device *dev, int enable)
+{
+    if (dev->ops != &ether_udp_ops) {
+        errorf("not a udp device, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->offload = enable ? 1 : 0;
+    /* NOTE: the pieces cut by GSO go out together as one datagram (UDP_SEGMENT) */
+    dev->gso_max_size = enable ? NET_DEVICE_GSO_MAX_SIZE : 0;
+    debugf("dev=%s, offload=%s", dev->name, enable ? "on" : "off");
+    return 0;
+}
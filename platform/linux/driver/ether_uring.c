@@ -0,0 +1,517 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_uring.h"
+
+#define ETHER_URING_ENTRIES  256
+#define ETHER_URING_RX_NUM   64  /* provided buffers (power of 2) */
+#define ETHER_URING_RX_DEPTH 16  /* reads in flight (at most ETHER_URING_RX_NUM) */
+#define ETHER_URING_TX_NUM   128 /* TX slots in flight */
+#define ETHER_URING_BUF_SIZE 2048 /* at least, grows with the MTU */
+#define ETHER_URING_BGID     0
+
+#define ETHER_URING_SQ_IDLE 1000 /* msec */
+
+#define ETHER_URING_DATA_STOP  0
+#define ETHER_URING_DATA_RX    1
+#define ETHER_URING_DATA_KICK  2
+#define ETHER_URING_DATA_TX(x) (3 + (x))
+
+struct ether_uring {
+    struct net_device *dev;
+    int fd; /* target file (tap or packet socket) */
+    int ring;
+    int flags;
+    /* submission queue */
+    void *sq_map;
+    size_t sq_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_flags;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* completion queue */
+    void *cq_map;
+    size_t cq_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+    /* RX (provided buffer ring) */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    uint16_t br_tail;
+    uint8_t *rxbufs;
+    size_t bufsiz;
+    /* TX */
+    uint8_t *txbufs;
+    uint16_t free[ETHER_URING_TX_NUM];
+    unsigned int nfree;
+    mutex_t mutex; /* for submission queue and TX slots */
+    /* doorbell, the thread submits the queued entries when woken up */
+    int efd;
+    uint64_t kick;
+    int sleeping;
+    int running;
+    pthread_t thread;
+};
+
+static int
+ether_uring_enter(struct ether_uring *uring, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, uring->ring, to_submit, min_complete, flags, NULL, 0);
+}
+
+/* NOTE: must be called after locking mutex */
+static struct io_uring_sqe *
+ether_uring_sqe_get(struct ether_uring *uring)
+{
+    uint32_t head, tail;
+    struct io_uring_sqe *sqe;
+
+    head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+    tail = *uring->sq_tail;
+    if (tail - head == ETHER_URING_ENTRIES) {
+        return NULL;
+    }
+    sqe = &uring->sqes[tail & *uring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * NOTE: must be called after locking mutex, the entry is only queued here and
+ * submitted by the thread together with the others (see ether_uring_thread)
+ */
+static void
+ether_uring_sqe_push(struct ether_uring *uring)
+{
+    uint32_t tail;
+
+    tail = *uring->sq_tail;
+    uring->sq_array[tail & *uring->sq_mask] = tail & *uring->sq_mask;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* NOTE: called after pushing the entries (without locking mutex) */
+static void
+ether_uring_flush(struct ether_uring *uring)
+{
+    uint64_t one = 1;
+
+    if (uring->flags & ETHER_URING_FLAG_SQPOLL) {
+        /* the kernel thread picks it up, a syscall only when it sleeps */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!(__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)) {
+            return;
+        }
+        if (ether_uring_enter(uring, 0, 0, IORING_ENTER_SQ_WAKEUP) == -1) {
+            errorf("io_uring_enter: %s, dev=%s", strerror(errno), uring->dev->name);
+        }
+        return;
+    }
+    /* NOTE: only the first one after the thread went to sleep rings, the rest are submitted with it */
+    if (__atomic_exchange_n(&uring->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        if (write(uring->efd, &one, sizeof(one)) == -1) {
+            errorf("write: %s, dev=%s", strerror(errno), uring->dev->name);
+        }
+    }
+}
+
+/* NOTE: must be called after locking mutex */
+static int
+ether_uring_rx_post(struct ether_uring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ether_uring_sqe_get(uring);
+    if (!sqe) {
+        errorf("submission queue is full, dev=%s", uring->dev->name);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = uring->fd;
+    sqe->off = (uint64_t)-1; /* current position (not seekable) */
+    sqe->len = uring->bufsiz;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ETHER_URING_BGID;
+    sqe->user_data = ETHER_URING_DATA_RX;
+    ether_uring_sqe_push(uring);
+    return 0;
+}
+
+/* NOTE: must be called after locking mutex */
+static int
+ether_uring_kick_post(struct ether_uring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ether_uring_sqe_get(uring);
+    if (!sqe) {
+        errorf("submission queue is full, dev=%s", uring->dev->name);
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = uring->efd;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uintptr_t)&uring->kick;
+    sqe->len = sizeof(uring->kick);
+    sqe->user_data = ETHER_URING_DATA_KICK;
+    ether_uring_sqe_push(uring);
+    return 0;
+}
+
+static void
+ether_uring_rx_recycle(struct ether_uring *uring, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+
+    buf = &uring->br->bufs[uring->br_tail & (ETHER_URING_RX_NUM - 1)];
+    buf->addr = (uintptr_t)(uring->rxbufs + bid * uring->bufsiz);
+    buf->len = uring->bufsiz;
+    buf->bid = bid;
+    uring->br_tail++;
+    __atomic_store_n(&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+static int
+ether_uring_complete(struct ether_uring *uring, struct io_uring_cqe *cqe)
+{
+    uint16_t bid;
+
+    switch (cqe->user_data) {
+    case ETHER_URING_DATA_STOP:
+        return -1;
+    case ETHER_URING_DATA_RX:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0) {
+                ether_input_helper(uring->dev, uring->rxbufs + bid * uring->bufsiz, cqe->res, 0);
+            }
+            ether_uring_rx_recycle(uring, bid);
+        }
+        if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ENOBUFS) {
+            errorf("read: %s, dev=%s", strerror(-cqe->res), uring->dev->name);
+        }
+        /* NOTE: always posted again, otherwise nothing is received any more */
+        mutex_lock(&uring->mutex);
+        if (ether_uring_rx_post(uring) == -1) {
+            errorf("ether_uring_rx_post() failure, receiving stopped, dev=%s", uring->dev->name);
+        }
+        mutex_unlock(&uring->mutex);
+        break;
+    case ETHER_URING_DATA_KICK:
+        /* NOTE: nothing to do, the queued entries are submitted when going back to sleep */
+        mutex_lock(&uring->mutex);
+        if (ether_uring_kick_post(uring) == -1) {
+            errorf("ether_uring_kick_post() failure, dev=%s", uring->dev->name);
+        }
+        mutex_unlock(&uring->mutex);
+        break;
+    default:
+        if (cqe->res < 0) {
+            errorf("write: %s, dev=%s", strerror(-cqe->res), uring->dev->name);
+        }
+        mutex_lock(&uring->mutex);
+        uring->free[uring->nfree++] = cqe->user_data - ETHER_URING_DATA_TX(0);
+        mutex_unlock(&uring->mutex);
+        break;
+    }
+    return 0;
+}
+
+/*
+ * The thread submits the queued entries (the reads posted again and the writes of
+ * the other threads) and waits for the completions in a single io_uring_enter().
+ * Before that it marks itself sleeping, the writers queueing after the mark ring
+ * the doorbell (eventfd) and it comes back to submit their entries.
+ */
+static void *
+ether_uring_thread(void *arg)
+{
+    struct ether_uring *uring;
+    uint32_t head, tail;
+    unsigned int flags;
+    int stop = 0;
+
+    uring = (struct ether_uring *)arg;
+    while (!stop) {
+        head = *uring->cq_head;
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            if (ether_uring_complete(uring, &uring->cqes[head & *uring->cq_mask]) == -1) {
+                stop = 1;
+            }
+        }
+        __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+        if (stop) {
+            break;
+        }
+        flags = IORING_ENTER_GETEVENTS;
+        if (uring->flags & ETHER_URING_FLAG_SQPOLL) {
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+                flags |= IORING_ENTER_SQ_WAKEUP;
+            }
+        } else {
+            __atomic_store_n(&uring->sleeping, 1, __ATOMIC_SEQ_CST);
+        }
+        /* NOTE: the kernel submits the entries queued so far (at most the number passed) */
+        if (ether_uring_enter(uring, ETHER_URING_ENTRIES, 1, flags) == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                continue;
+            }
+            errorf("io_uring_enter: %s, dev=%s", strerror(errno), uring->dev->name);
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int
+ether_uring_setup(struct ether_uring *uring)
+{
+    struct io_uring_params params = {};
+    struct io_uring_buf_reg reg = {};
+    uint8_t *sq, *cq;
+
+    if (uring->flags & ETHER_URING_FLAG_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = ETHER_URING_SQ_IDLE;
+    }
+    uring->ring = syscall(__NR_io_uring_setup, ETHER_URING_ENTRIES, &params);
+    if (uring->ring == -1) {
+        errorf("io_uring_setup: %s, dev=%s", strerror(errno), uring->dev->name);
+        return -1;
+    }
+    uring->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    uring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->sq_size = uring->cq_size = MAX(uring->sq_size, uring->cq_size);
+    }
+    uring->sq_map = mmap(NULL, uring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring, IORING_OFF_SQ_RING);
+    if (uring->sq_map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), uring->dev->name);
+        uring->sq_map = NULL;
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_map = uring->sq_map;
+    } else {
+        uring->cq_map = mmap(NULL, uring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring, IORING_OFF_CQ_RING);
+        if (uring->cq_map == MAP_FAILED) {
+            errorf("mmap: %s, dev=%s", strerror(errno), uring->dev->name);
+            uring->cq_map = NULL;
+            return -1;
+        }
+    }
+    uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring, IORING_OFF_SQES);
+    if (uring->sqes == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), uring->dev->name);
+        uring->sqes = NULL;
+        return -1;
+    }
+    sq = uring->sq_map;
+    uring->sq_head = (uint32_t *)(sq + params.sq_off.head);
+    uring->sq_tail = (uint32_t *)(sq + params.sq_off.tail);
+    uring->sq_mask = (uint32_t *)(sq + params.sq_off.ring_mask);
+    uring->sq_flags = (uint32_t *)(sq + params.sq_off.flags);
+    uring->sq_array = (uint32_t *)(sq + params.sq_off.array);
+    cq = uring->cq_map;
+    uring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+    uring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+    uring->cq_mask = (uint32_t *)(cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    /* the kernel picks a free RX buffer from this ring */
+    uring->br_size = ETHER_URING_RX_NUM * sizeof(struct io_uring_buf);
+    uring->br = mmap(NULL, uring->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (uring->br == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), uring->dev->name);
+        uring->br = NULL;
+        return -1;
+    }
+    reg.ring_addr = (uintptr_t)uring->br;
+    reg.ring_entries = ETHER_URING_RX_NUM;
+    reg.bgid = ETHER_URING_BGID;
+    if (syscall(__NR_io_uring_register, uring->ring, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        errorf("io_uring_register(IORING_REGISTER_PBUF_RING): %s, dev=%s", strerror(errno), uring->dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+ether_uring_free(struct ether_uring *uring)
+{
+    if (uring->ring != -1) {
+        close(uring->ring);
+    }
+    if (uring->efd != -1) {
+        close(uring->efd);
+    }
+    if (uring->sqes) {
+        munmap(uring->sqes, uring->sqes_size);
+    }
+    if (uring->cq_map && uring->cq_map != uring->sq_map) {
+        munmap(uring->cq_map, uring->cq_size);
+    }
+    if (uring->sq_map) {
+        munmap(uring->sq_map, uring->sq_size);
+    }
+    if (uring->br) {
+        munmap(uring->br, uring->br_size);
+    }
+    memory_free(uring->rxbufs);
+    memory_free(uring->txbufs);
+    memory_free(uring);
+}
+
+struct ether_uring *
+ether_uring_open(struct net_device *dev, int fd, int flags)
+{
+    struct ether_uring *uring;
+    unsigned int i;
+    int err;
+
+    uring = memory_alloc(sizeof(*uring));
+    if (!uring) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    uring->dev = dev;
+    uring->fd = fd;
+    uring->ring = -1;
+    uring->flags = flags;
+    mutex_init(&uring->mutex);
+    uring->efd = eventfd(0, EFD_CLOEXEC);
+    if (uring->efd == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+        ether_uring_free(uring);
+        return NULL;
+    }
+    uring->bufsiz = MAX(ETHER_URING_BUF_SIZE, (dev->hlen + dev->mtu + 63) & ~63);
+    uring->rxbufs = memory_alloc(ETHER_URING_RX_NUM * uring->bufsiz);
+    uring->txbufs = memory_alloc(ETHER_URING_TX_NUM * uring->bufsiz);
+    if (!uring->rxbufs || !uring->txbufs) {
+        errorf("memory_alloc() failure");
+        ether_uring_free(uring);
+        return NULL;
+    }
+    if (ether_uring_setup(uring) == -1) {
+        ether_uring_free(uring);
+        return NULL;
+    }
+    for (i = 0; i < ETHER_URING_RX_NUM; i++) {
+        ether_uring_rx_recycle(uring, i);
+    }
+    for (i = 0; i < ETHER_URING_TX_NUM; i++) {
+        uring->free[i] = i;
+    }
+    uring->nfree = ETHER_URING_TX_NUM;
+    /* NOTE: submitted by the first io_uring_enter() of the thread */
+    mutex_lock(&uring->mutex);
+    err = ether_uring_kick_post(uring);
+    for (i = 0; err != -1 && i < ETHER_URING_RX_DEPTH; i++) {
+        err = ether_uring_rx_post(uring);
+    }
+    mutex_unlock(&uring->mutex);
+    if (err == -1) {
+        errorf("ether_uring_rx_post() failure, dev=%s", dev->name);
+        ether_uring_free(uring);
+        return NULL;
+    }
+    err = pthread_create(&uring->thread, NULL, ether_uring_thread, uring);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        ether_uring_free(uring);
+        return NULL;
+    }
+    uring->running = 1;
+    debugf("dev=%s, fd=%d, sqpoll=%s, reads=%d", dev->name, fd, (flags & ETHER_URING_FLAG_SQPOLL) ? "on" : "off", ETHER_URING_RX_DEPTH);
+    return uring;
+}
+
+void
+ether_uring_close(struct ether_uring *uring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring->running) {
+        mutex_lock(&uring->mutex);
+        sqe = ether_uring_sqe_get(uring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_NOP;
+            sqe->user_data = ETHER_URING_DATA_STOP;
+            ether_uring_sqe_push(uring);
+        }
+        mutex_unlock(&uring->mutex);
+        if (sqe) {
+            ether_uring_flush(uring);
+            pthread_join(uring->thread, NULL);
+        } else {
+            pthread_cancel(uring->thread);
+            pthread_join(uring->thread, NULL);
+        }
+    }
+    /* NOTE: the pending reads are canceled when the ring is closed */
+    ether_uring_free(uring);
+}
+
+/* NOTE: the fragments are gathered into the TX slot, it must live until the completion */
+ssize_t
+ether_uring_writev(struct ether_uring *uring, const struct iovec *iov, int iovcnt)
+{
+    struct io_uring_sqe *sqe;
+    uint16_t slot;
+    uint8_t *buf;
+    size_t flen;
+
+    flen = iovec_len(iov, iovcnt);
+    if (flen > uring->bufsiz) {
+        errorf("too long, dev=%s, len=%zu", uring->dev->name, flen);
+        return -1;
+    }
+    mutex_lock(&uring->mutex);
+    if (!uring->nfree) {
+        mutex_unlock(&uring->mutex);
+        errorf("no free slot, dev=%s", uring->dev->name);
+        return -1;
+    }
+    sqe = ether_uring_sqe_get(uring);
+    if (!sqe) {
+        mutex_unlock(&uring->mutex);
+        errorf("submission queue is full, dev=%s", uring->dev->name);
+        return -1;
+    }
+    slot = uring->free[--uring->nfree];
+    buf = uring->txbufs + slot * uring->bufsiz;
+    iovec_gather(buf, flen, iov, iovcnt);
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = uring->fd;
+    sqe->off = (uint64_t)-1; /* current position (not seekable) */
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = flen;
+    sqe->user_data = ETHER_URING_DATA_TX(slot);
+    ether_uring_sqe_push(uring);
+    mutex_unlock(&uring->mutex);
+    ether_uring_flush(uring);
+    return flen;
+}
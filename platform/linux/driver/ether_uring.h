@@ -0,0 +1,21 @@
+#ifndef ETHER_URING_H
+#define ETHER_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "net.h"
+
+#define ETHER_URING_FLAG_SQPOLL 0x0001
+
+struct ether_uring; /* forward declaration */
+
+extern struct ether_uring *
+ether_uring_open(struct net_device *dev, int fd, int flags);
+extern void
+ether_uring_close(struct ether_uring *uring);
+extern ssize_t
+ether_uring_writev(struct ether_uring *uring, const struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_veth.h"
+
+struct ether_veth_entry {
+    uint64_t due; /* nsec (CLOCK_MONOTONIC) */
+    uint64_t seq; /* keep the order of frames with the same due */
+    size_t len;
+    uint8_t data[];
+};
+
+/*
+ * Each device has its own egress queue (a min-heap ordered by due time)
+ * and a thread which delivers the frames to the peer when they are due.
+ */
+struct ether_veth {
+    struct net_device *peer;
+    struct ether_veth_netem netem;
+    uint64_t busy; /* the link is serializing until this time (for rate) */
+    uint64_t seq;
+    uint32_t seed;
+    struct ether_veth_entry *heap[ETHER_VETH_LIMIT_MAX];
+    size_t num;
+    /* statistics */
+    size_t frames;
+    size_t drops;
+    size_t dups;
+    mutex_t mutex; /* for everything above */
+    pthread_cond_t cond;
+    int running;
+    pthread_t thread;
+};
+
+#define PRIV(x) ((struct ether_veth *)x->priv)
+
+static uint64_t
+ether_veth_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift32 */
+static uint32_t
+ether_veth_random(struct ether_veth *veth)
+{
+    uint32_t x = veth->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    veth->seed = x;
+    return x;
+}
+
+static int
+ether_veth_chance(struct ether_veth *veth, double percent)
+{
+    if (percent <= 0) {
+        return 0;
+    }
+    return ether_veth_random(veth) < (uint32_t)(UINT32_MAX * (MIN(percent, 100.0) / 100));
+}
+
+static int
+ether_veth_entry_before(const struct ether_veth_entry *a, const struct ether_veth_entry *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+/* NOTE: must be called after locking veth->mutex */
+static void
+ether_veth_heap_push(struct ether_veth *veth, struct ether_veth_entry *entry)
+{
+    size_t i, parent;
+
+    i = veth->num++;
+    while (i) {
+        parent = (i - 1) / 2;
+        if (!ether_veth_entry_before(entry, veth->heap[parent])) {
+            break;
+        }
+        veth->heap[i] = veth->heap[parent];
+        i = parent;
+    }
+    veth->heap[i] = entry;
+}
+
+/* NOTE: must be called after locking veth->mutex */
+static struct ether_veth_entry *
+ether_veth_heap_pop(struct ether_veth *veth)
+{
+    struct ether_veth_entry *top, *last;
+    size_t i, child;
+
+    top = veth->heap[0];
+    last = veth->heap[--veth->num];
+    i = 0;
+    while ((child = i * 2 + 1) < veth->num) {
+        if (child + 1 < veth->num && ether_veth_entry_before(veth->heap[child+1], veth->heap[child])) {
+            child++;
+        }
+        if (!ether_veth_entry_before(veth->heap[child], last)) {
+            break;
+        }
+        veth->heap[i] = veth->heap[child];
+        i = child;
+    }
+    veth->heap[i] = last;
+    return top;
+}
+
+static void *
+ether_veth_thread(void *arg)
+{
+    struct net_device *dev;
+    struct ether_veth *veth;
+    struct ether_veth_entry *entry;
+    struct timespec ts;
+    uint64_t now;
+
+    dev = (struct net_device *)arg;
+    veth = PRIV(dev);
+    mutex_lock(&veth->mutex);
+    while (veth->running) {
+        if (!veth->num) {
+            pthread_cond_wait(&veth->cond, &veth->mutex);
+            continue;
+        }
+        now = ether_veth_now();
+        if (veth->heap[0]->due > now) {
+            ts.tv_sec = veth->heap[0]->due / 1000000000;
+            ts.tv_nsec = veth->heap[0]->due % 1000000000;
+            pthread_cond_timedwait(&veth->cond, &veth->mutex, &ts);
+            continue;
+        }
+        entry = ether_veth_heap_pop(veth);
+        mutex_unlock(&veth->mutex);
+        if (NET_DEVICE_IS_UP(veth->peer)) {
+            /* NOTE: frames never leave the process, checksums are trusted */
+            ether_input_helper(veth->peer, entry->data, entry->len, NET_INPUT_FLAG_CSUM_VALID);
+        }
+        memory_free(entry);
+        mutex_lock(&veth->mutex);
+    }
+    mutex_unlock(&veth->mutex);
+    return NULL;
+}
+
+static int
+ether_veth_close(struct net_device *dev)
+{
+    struct ether_veth *veth;
+
+    veth = PRIV(dev);
+    if (veth->running) {
+        mutex_lock(&veth->mutex);
+        veth->running = 0;
+        pthread_cond_signal(&veth->cond);
+        mutex_unlock(&veth->mutex);
+        pthread_join(veth->thread, NULL);
+    }
+    while (veth->num) {
+        memory_free(ether_veth_heap_pop(veth));
+    }
+    infof("dev=%s, frames=%zu, drops=%zu, dups=%zu", dev->name, veth->frames, veth->drops, veth->dups);
+    return 0;
+}
+
+static int
+ether_veth_open(struct net_device *dev)
+{
+    struct ether_veth *veth;
+    int err;
+
+    veth = PRIV(dev);
+    if (!veth->peer) {
+        errorf("no peer, dev=%s", dev->name);
+        return -1;
+    }
+    veth->seed = ether_veth_now() | 1;
+    veth->busy = 0;
+    veth->running = 1;
+    err = pthread_create(&veth->thread, NULL, ether_veth_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        veth->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: must be called after locking veth->mutex */
+static int
+ether_veth_enqueue(struct ether_veth *veth, const struct iovec *iov, int iovcnt, size_t flen, uint64_t due)
+{
+    struct ether_veth_entry *entry;
+
+    if (veth->num >= (veth->netem.limit ? veth->netem.limit : ETHER_VETH_LIMIT_DEFAULT)) {
+        veth->drops++;
+        return -1;
+    }
+    entry = memory_alloc(sizeof(*entry) + flen);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->due = due;
+    entry->seq = veth->seq++;
+    entry->len = flen;
+    iovec_gather(entry->data, flen, iov, iovcnt);
+    ether_veth_heap_push(veth, entry);
+    return 0;
+}
+
+static ssize_t
+ether_veth_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    struct ether_veth *veth;
+    struct ether_veth_netem *netem;
+    uint64_t now, due;
+    int64_t jitter;
+    size_t flen;
+
+    flen = iovec_len(iov, iovcnt);
+    veth = PRIV(dev);
+    netem = &veth->netem;
+    mutex_lock(&veth->mutex);
+    veth->frames++;
+    if (ether_veth_chance(veth, netem->loss)) {
+        veth->drops++;
+        mutex_unlock(&veth->mutex);
+        /* NOTE: lost on the wire, not a transmit error */
+        return flen;
+    }
+    now = ether_veth_now();
+    due = now;
+    if (netem->rate) {
+        veth->busy = MAX(veth->busy, now) + (uint64_t)flen * 8 * 1000000000 / netem->rate;
+        due = veth->busy;
+    }
+    if (!ether_veth_chance(veth, netem->reorder)) {
+        due += (uint64_t)netem->delay * 1000;
+        if (netem->jitter) {
+            jitter = (int64_t)(ether_veth_random(veth) % (netem->jitter * 2 + 1)) - (int64_t)netem->jitter;
+            due = (jitter < 0 && (uint64_t)-jitter * 1000 > due - now) ? now : due + jitter * 1000;
+        }
+    }
+    if (ether_veth_enqueue(veth, iov, iovcnt, flen, due) == 0 && ether_veth_chance(veth, netem->duplicate)) {
+        if (ether_veth_enqueue(veth, iov, iovcnt, flen, due) == 0) {
+            veth->dups++;
+        }
+    }
+    pthread_cond_signal(&veth->cond);
+    mutex_unlock(&veth->mutex);
+    return flen;
+}
+
+int
+ether_veth_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_veth_writev);
+}
+
+static struct net_device_ops ether_veth_ops = {
+    .open = ether_veth_open,
+    .close = ether_veth_close,
+    .transmit_iov = ether_veth_transmit_iov,
+};
+
+static void
+ether_veth_setup(struct net_device *dev)
+{
+    ether_setup_helper(dev);
+    /* NOTE: frames never leave the process */
+    dev->features = NET_DEVICE_FEATURE_CSUM_TX | NET_DEVICE_FEATURE_CSUM_RX;
+}
+
+struct net_device *
+ether_veth_init(const char *addr, struct net_device *peer)
+{
+    struct net_device *dev;
+    struct ether_veth *veth;
+    pthread_condattr_t attr;
+
+    if (peer && (peer->ops != &ether_veth_ops || PRIV(peer)->peer)) {
+        errorf("peer is not an unpaired veth device, peer=%s", peer->name);
+        return NULL;
+    }
+    dev = net_device_alloc(ether_veth_setup);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_veth_ops;
+    veth = memory_alloc(sizeof(*veth));
+    if (!veth) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    mutex_init(&veth->mutex);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&veth->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    dev->priv = veth;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(veth);
+        return NULL;
+    }
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        /* locally administered address, unique in this process */
+        dev->addr[0] = 0x02;
+        dev->addr[ETHER_ADDR_LEN-1] = dev->index + 1;
+    }
+    if (peer) {
+        veth->peer = peer;
+        PRIV(peer)->peer = dev;
+        debugf("ethernet device initialized, dev=%s, peer=%s", dev->name, peer->name);
+    } else {
+        debugf("ethernet device initialized, dev=%s", dev->name);
+    }
+    return dev;
+}
+
+int
+ether_veth_set_netem(struct net_device *dev, const struct ether_veth_netem *netem)
+{
+    struct ether_veth *veth;
+
+    if (dev->ops != &ether_veth_ops) {
+        errorf("not a veth device, dev=%s", dev->name);
+        return -1;
+    }
+    if (netem->limit > ETHER_VETH_LIMIT_MAX) {
+        errorf("too large limit, dev=%s, limit=%zu", dev->name, netem->limit);
+        return -1;
+    }
+    veth = PRIV(dev);
+    mutex_lock(&veth->mutex);
+    veth->netem = *netem;
+    mutex_unlock(&veth->mutex);
+    debugf("dev=%s, delay=%luus, jitter=%luus, rate=%lubps, loss=%.2f%%, reorder=%.2f%%, duplicate=%.2f%%",
+        dev->name, netem->delay, netem->jitter, netem->rate, netem->loss, netem->reorder, netem->duplicate);
+    return 0;
+}
@@ -0,0 +1,506 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <linux/vhost.h>
+#include <linux/virtio_net.h>
+#include <linux/virtio_ring.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_vhost.h"
+
+#define CLONE_DEVICE "/dev/net/tun"
+#define VHOST_DEVICE "/dev/vhost-net"
+
+#define ETHER_VHOST_RX 0
+#define ETHER_VHOST_TX 1
+
+#define ETHER_VHOST_RING_SIZE  256 /* number of descriptors (power of 2) */
+#define ETHER_VHOST_RING_ALIGN 4096
+#define ETHER_VHOST_BUF_SIZE   2048 /* virtio_net_hdr + frame */
+
+#define ETHER_VHOST_BUSY_POLL 64 /* empty rounds before waiting for the notification */
+
+struct ether_vhost_queue {
+    struct vring vring;
+    uint8_t *bufs; /* ETHER_VHOST_RING_SIZE * ETHER_VHOST_BUF_SIZE */
+    uint16_t avail_idx; /* next index to publish in the avail ring */
+    uint16_t used_idx;  /* next index to consume in the used ring */
+    uint16_t free[ETHER_VHOST_RING_SIZE]; /* unused descriptors (TX only) */
+    unsigned int nfree;
+    int kick; /* eventfd: driver -> vhost */
+    int call; /* eventfd: vhost -> driver */
+};
+
+struct ether_vhost {
+    char name[IFNAMSIZ];
+    int tap;
+    int vhost;
+    void *mem; /* rings and buffers shared with the kernel */
+    size_t size;
+    struct ether_vhost_queue queues[2]; /* RX, TX */
+    mutex_t mutex; /* for TX queue */
+    pthread_t thread;
+    int event; /* eventfd to stop the thread */
+};
+
+#define PRIV(x) ((struct ether_vhost *)x->priv)
+
+#define ETHER_VHOST_HDR_SIZE (sizeof(struct virtio_net_hdr))
+#define ETHER_VHOST_QUEUE_SIZE \
+    ((vring_size(ETHER_VHOST_RING_SIZE, ETHER_VHOST_RING_ALIGN) + ETHER_VHOST_RING_ALIGN - 1) / ETHER_VHOST_RING_ALIGN * ETHER_VHOST_RING_ALIGN \
+     + ETHER_VHOST_RING_SIZE * ETHER_VHOST_BUF_SIZE)
+
+static int
+ether_vhost_addr(struct net_device *dev) {
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ifr.ifr_addr.sa_family = AF_INET;
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    memcpy(dev->addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    close(soc);
+    return 0;
+}
+
+static void
+ether_vhost_kick(struct ether_vhost_queue *queue)
+{
+    __sync_synchronize(); /* publish avail->idx before reading used->flags */
+    if (!(queue->vring.used->flags & VRING_USED_F_NO_NOTIFY)) {
+        eventfd_write(queue->kick, 1);
+    }
+}
+
+static int
+ether_vhost_queue_setup(struct net_device *dev, unsigned int index, uint8_t *mem)
+{
+    struct ether_vhost *vhost;
+    struct ether_vhost_queue *queue;
+    struct vhost_vring_state state;
+    struct vhost_vring_addr addr = {};
+    struct vhost_vring_file file;
+
+    vhost = PRIV(dev);
+    queue = &vhost->queues[index];
+    vring_init(&queue->vring, ETHER_VHOST_RING_SIZE, mem, ETHER_VHOST_RING_ALIGN);
+    queue->bufs = mem + ETHER_VHOST_QUEUE_SIZE - ETHER_VHOST_RING_SIZE * ETHER_VHOST_BUF_SIZE;
+    queue->kick = eventfd(0, EFD_NONBLOCK);
+    queue->call = eventfd(0, EFD_NONBLOCK);
+    if (queue->kick == -1 || queue->call == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    state.index = index;
+    state.num = ETHER_VHOST_RING_SIZE;
+    if (ioctl(vhost->vhost, VHOST_SET_VRING_NUM, &state) == -1) {
+        errorf("ioctl(VHOST_SET_VRING_NUM): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    state.num = 0;
+    if (ioctl(vhost->vhost, VHOST_SET_VRING_BASE, &state) == -1) {
+        errorf("ioctl(VHOST_SET_VRING_BASE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    addr.index = index;
+    addr.desc_user_addr = (uintptr_t)queue->vring.desc;
+    addr.avail_user_addr = (uintptr_t)queue->vring.avail;
+    addr.used_user_addr = (uintptr_t)queue->vring.used;
+    if (ioctl(vhost->vhost, VHOST_SET_VRING_ADDR, &addr) == -1) {
+        errorf("ioctl(VHOST_SET_VRING_ADDR): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    file.index = index;
+    file.fd = queue->kick;
+    if (ioctl(vhost->vhost, VHOST_SET_VRING_KICK, &file) == -1) {
+        errorf("ioctl(VHOST_SET_VRING_KICK): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    file.fd = queue->call;
+    if (ioctl(vhost->vhost, VHOST_SET_VRING_CALL, &file) == -1) {
+        errorf("ioctl(VHOST_SET_VRING_CALL): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ether_vhost_rx(struct net_device *dev)
+{
+    struct ether_vhost_queue *queue;
+    struct vring_used_elem *elem;
+    uint8_t *buf;
+    int count = 0;
+
+    queue = &PRIV(dev)->queues[ETHER_VHOST_RX];
+    while (queue->used_idx != *(volatile uint16_t *)&queue->vring.used->idx) {
+        __sync_synchronize(); /* read the entry after used->idx */
+        elem = &queue->vring.used->ring[queue->used_idx % ETHER_VHOST_RING_SIZE];
+        buf = queue->bufs + elem->id * ETHER_VHOST_BUF_SIZE;
+        if (elem->len > ETHER_VHOST_HDR_SIZE) {
+            ether_input_helper(dev, buf + ETHER_VHOST_HDR_SIZE, elem->len - ETHER_VHOST_HDR_SIZE, 0);
+        }
+        /* give the buffer back */
+        queue->vring.avail->ring[queue->avail_idx % ETHER_VHOST_RING_SIZE] = elem->id;
+        queue->avail_idx++;
+        queue->used_idx++;
+        count++;
+    }
+    if (count) {
+        __sync_synchronize(); /* publish the entries before avail->idx */
+        queue->vring.avail->idx = queue->avail_idx;
+        ether_vhost_kick(queue);
+    }
+    return count;
+}
+
+/* NOTE: suppress the notification while frames keep coming */
+static int
+ether_vhost_busy_poll(struct net_device *dev)
+{
+    struct ether_vhost_queue *queue;
+    int idle, count = 0, ret;
+
+    queue = &PRIV(dev)->queues[ETHER_VHOST_RX];
+    queue->vring.avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    for (idle = 0; idle < ETHER_VHOST_BUSY_POLL; idle++) {
+        ret = ether_vhost_rx(dev);
+        if (ret) {
+            count += ret;
+            idle = 0;
+        }
+    }
+    queue->vring.avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    __sync_synchronize();
+    /* frames arrived before the flag became visible */
+    return count + ether_vhost_rx(dev);
+}
+
+static void *
+ether_vhost_thread(void *arg)
+{
+    struct net_device *dev;
+    struct pollfd pfds[2];
+    eventfd_t val;
+    int busy;
+
+    dev = (struct net_device *)arg;
+    pfds[0].fd = PRIV(dev)->queues[ETHER_VHOST_RX].call;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = PRIV(dev)->event;
+    pfds[1].events = POLLIN;
+    while (1) {
+        busy = ether_vhost_busy_poll(dev);
+        if (poll(pfds, countof(pfds), busy ? 0 : -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            break;
+        }
+        if (pfds[0].revents & POLLIN) {
+            eventfd_read(pfds[0].fd, &val);
+        }
+    }
+    return NULL;
+}
+
+static int
+ether_vhost_close(struct net_device *dev)
+{
+    struct ether_vhost *vhost;
+    unsigned int i;
+
+    vhost = PRIV(dev);
+    if (vhost->thread) {
+        eventfd_write(vhost->event, 1);
+        pthread_join(vhost->thread, NULL);
+        vhost->thread = 0;
+    }
+    if (vhost->event != -1) {
+        close(vhost->event);
+        vhost->event = -1;
+    }
+    if (vhost->vhost != -1) {
+        close(vhost->vhost);
+        vhost->vhost = -1;
+    }
+    if (vhost->tap != -1) {
+        close(vhost->tap);
+        vhost->tap = -1;
+    }
+    for (i = 0; i < countof(vhost->queues); i++) {
+        if (vhost->queues[i].kick != -1) {
+            close(vhost->queues[i].kick);
+            vhost->queues[i].kick = -1;
+        }
+        if (vhost->queues[i].call != -1) {
+            close(vhost->queues[i].call);
+            vhost->queues[i].call = -1;
+        }
+    }
+    if (vhost->mem) {
+        munmap(vhost->mem, vhost->size);
+        vhost->mem = NULL;
+    }
+    return 0;
+}
+
+static int
+ether_vhost_open(struct net_device *dev)
+{
+    struct ether_vhost *vhost;
+    struct ifreq ifr = {};
+    struct vhost_memory *table;
+    struct vhost_vring_file file;
+    uint64_t features;
+    unsigned int i;
+    int err;
+
+    vhost = PRIV(dev);
+    if (ETHER_VHOST_HDR_SIZE + dev->hlen + dev->mtu > ETHER_VHOST_BUF_SIZE) {
+        errorf("jumbo frames are not supported, dev=%s, mtu=%u", dev->name, dev->mtu);
+        return -1;
+    }
+    vhost->tap = open(CLONE_DEVICE, O_RDWR | O_NONBLOCK);
+    if (vhost->tap == -1) {
+        errorf("open: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, vhost->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    if (ioctl(vhost->tap, TUNSETIFF, &ifr) == -1) {
+        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    vhost->vhost = open(VHOST_DEVICE, O_RDWR);
+    if (vhost->vhost == -1) {
+        errorf("open: %s, dev=%s", strerror(errno), dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    if (ioctl(vhost->vhost, VHOST_SET_OWNER, NULL) == -1) {
+        errorf("ioctl(VHOST_SET_OWNER): %s, dev=%s", strerror(errno), dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    /* NOTE: no offload features, the tap handles the virtio_net_hdr as is */
+    features = 0;
+    if (ioctl(vhost->vhost, VHOST_SET_FEATURES, &features) == -1) {
+        errorf("ioctl(VHOST_SET_FEATURES): %s, dev=%s", strerror(errno), dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    vhost->size = ETHER_VHOST_QUEUE_SIZE * countof(vhost->queues);
+    vhost->mem = mmap(NULL, vhost->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vhost->mem == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        vhost->mem = NULL;
+        ether_vhost_close(dev);
+        return -1;
+    }
+    /* NOTE: identity mapping, descriptors hold our virtual addresses */
+    table = memory_alloc(sizeof(*table) + sizeof(table->regions[0]));
+    if (!table) {
+        errorf("memory_alloc() failure, dev=%s", dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    table->nregions = 1;
+    table->regions[0].guest_phys_addr = (uintptr_t)vhost->mem;
+    table->regions[0].memory_size = vhost->size;
+    table->regions[0].userspace_addr = (uintptr_t)vhost->mem;
+    err = ioctl(vhost->vhost, VHOST_SET_MEM_TABLE, table);
+    memory_free(table);
+    if (err == -1) {
+        errorf("ioctl(VHOST_SET_MEM_TABLE): %s, dev=%s", strerror(errno), dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    for (i = 0; i < countof(vhost->queues); i++) {
+        if (ether_vhost_queue_setup(dev, i, (uint8_t *)vhost->mem + ETHER_VHOST_QUEUE_SIZE * i) == -1) {
+            ether_vhost_close(dev);
+            return -1;
+        }
+    }
+    /* RX: hand all buffers to the kernel */
+    for (i = 0; i < ETHER_VHOST_RING_SIZE; i++) {
+        vhost->queues[ETHER_VHOST_RX].vring.desc[i].addr = (uintptr_t)(vhost->queues[ETHER_VHOST_RX].bufs + i * ETHER_VHOST_BUF_SIZE);
+        vhost->queues[ETHER_VHOST_RX].vring.desc[i].len = ETHER_VHOST_BUF_SIZE;
+        vhost->queues[ETHER_VHOST_RX].vring.desc[i].flags = VRING_DESC_F_WRITE;
+        vhost->queues[ETHER_VHOST_RX].vring.avail->ring[i] = i;
+    }
+    vhost->queues[ETHER_VHOST_RX].avail_idx = ETHER_VHOST_RING_SIZE;
+    vhost->queues[ETHER_VHOST_RX].vring.avail->idx = ETHER_VHOST_RING_SIZE;
+    /* TX: all descriptors are free, completion is collected lazily */
+    for (i = 0; i < ETHER_VHOST_RING_SIZE; i++) {
+        vhost->queues[ETHER_VHOST_TX].free[i] = i;
+    }
+    vhost->queues[ETHER_VHOST_TX].nfree = ETHER_VHOST_RING_SIZE;
+    vhost->queues[ETHER_VHOST_TX].vring.avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+    for (i = 0; i < countof(vhost->queues); i++) {
+        file.index = i;
+        file.fd = vhost->tap;
+        if (ioctl(vhost->vhost, VHOST_NET_SET_BACKEND, &file) == -1) {
+            errorf("ioctl(VHOST_NET_SET_BACKEND): %s, dev=%s", strerror(errno), dev->name);
+            ether_vhost_close(dev);
+            return -1;
+        }
+    }
+    eventfd_write(vhost->queues[ETHER_VHOST_RX].kick, 1);
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        if (ether_vhost_addr(dev) == -1) {
+            errorf("ether_vhost_addr() failure, dev=%s", dev->name);
+            ether_vhost_close(dev);
+            return -1;
+        }
+    }
+    vhost->event = eventfd(0, 0);
+    if (vhost->event == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+        ether_vhost_close(dev);
+        return -1;
+    }
+    err = pthread_create(&vhost->thread, NULL, ether_vhost_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        vhost->thread = 0;
+        ether_vhost_close(dev);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+ether_vhost_reclaim(struct ether_vhost_queue *queue)
+{
+    while (queue->used_idx != *(volatile uint16_t *)&queue->vring.used->idx) {
+        __sync_synchronize(); /* read the entry after used->idx */
+        queue->free[queue->nfree++] = queue->vring.used->ring[queue->used_idx % ETHER_VHOST_RING_SIZE].id;
+        queue->used_idx++;
+    }
+}
+
+static ssize_t
+ether_vhost_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    struct ether_vhost *vhost;
+    struct ether_vhost_queue *queue;
+    uint16_t id;
+    uint8_t *buf;
+    size_t flen;
+
+    flen = iovec_len(iov, iovcnt);
+    vhost = PRIV(dev);
+    queue = &vhost->queues[ETHER_VHOST_TX];
+    if (flen > ETHER_VHOST_BUF_SIZE - ETHER_VHOST_HDR_SIZE) {
+        errorf("too long, dev=%s, len=%zu", dev->name, flen);
+        return -1;
+    }
+    mutex_lock(&vhost->mutex);
+    ether_vhost_reclaim(queue);
+    if (!queue->nfree) {
+        mutex_unlock(&vhost->mutex);
+        errorf("ring is full, dev=%s", dev->name);
+        return -1;
+    }
+    id = queue->free[--queue->nfree];
+    buf = queue->bufs + id * ETHER_VHOST_BUF_SIZE;
+    memset(buf, 0, ETHER_VHOST_HDR_SIZE);
+    iovec_gather(buf + ETHER_VHOST_HDR_SIZE, flen, iov, iovcnt);
+    queue->vring.desc[id].addr = (uintptr_t)buf;
+    queue->vring.desc[id].len = ETHER_VHOST_HDR_SIZE + flen;
+    queue->vring.desc[id].flags = 0;
+    queue->vring.avail->ring[queue->avail_idx % ETHER_VHOST_RING_SIZE] = id;
+    queue->avail_idx++;
+    __sync_synchronize(); /* publish the entry before avail->idx */
+    queue->vring.avail->idx = queue->avail_idx;
+    ether_vhost_kick(queue);
+    mutex_unlock(&vhost->mutex);
+    return flen;
+}
+
+int
+ether_vhost_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_vhost_writev);
+}
+
+static struct net_device_ops ether_vhost_ops = {
+    .open = ether_vhost_open,
+    .close = ether_vhost_close,
+    .transmit_iov = ether_vhost_transmit_iov,
+};
+
+struct net_device *
+ether_vhost_init(const char *name, const char *addr)
+{
+    struct net_device *dev;
+    struct ether_vhost *vhost;
+    unsigned int i;
+
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_vhost_ops;
+    vhost = memory_alloc(sizeof(*vhost));
+    if (!vhost) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(vhost->name, name, sizeof(vhost->name)-1);
+    vhost->tap = -1;
+    vhost->vhost = -1;
+    vhost->event = -1;
+    for (i = 0; i < countof(vhost->queues); i++) {
+        vhost->queues[i].kick = -1;
+        vhost->queues[i].call = -1;
+    }
+    mutex_init(&vhost->mutex);
+    dev->priv = vhost;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(vhost);
+        return NULL;
+    }
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_xdp.h"
+
+#define ETHER_XDP_RING_SIZE  1024 /* number of entries (power of 2) */
+#define ETHER_XDP_FRAME_SIZE 2048 /* UMEM chunk size */
+#define ETHER_XDP_FRAME_NUM  (ETHER_XDP_RING_SIZE * 2) /* first half for RX, second half for TX */
+
+#define ETHER_XDP_QUEUE_ID 0
+
+struct ether_xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *ring;
+    void *map;
+    size_t size;
+};
+
+struct ether_xdp {
+    char name[IF_NAMESIZE];
+    int mode;
+    int fd; /* AF_XDP socket */
+    uint8_t *umem;
+    struct ether_xdp_ring fill;
+    struct ether_xdp_ring comp;
+    struct ether_xdp_ring rx;
+    struct ether_xdp_ring tx;
+    uint64_t free[ETHER_XDP_RING_SIZE]; /* unused TX frames */
+    unsigned int nfree;
+    mutex_t mutex; /* for TX and completion rings */
+    int map;  /* XSKMAP */
+    int prog; /* XDP program */
+    int link; /* NOTE: the program is detached when this is closed */
+    int running;
+    pthread_t thread;
+    int event; /* eventfd to stop the thread */
+};
+
+#define PRIV(x) ((struct ether_xdp *)x->priv)
+
+static int
+ether_xdp_addr(struct net_device *dev) {
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ifr.ifr_addr.sa_family = AF_INET;
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    memcpy(dev->addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    close(soc);
+    return 0;
+}
+
+static int
+ether_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+ * XDP program (redirect everything on the bound queue to the socket)
+ *
+ *   r2 = ctx->rx_queue_index
+ *   r1 = &xsks_map
+ *   r3 = XDP_PASS
+ *   return bpf_redirect_map(r1, r2, r3)
+ */
+static int
+ether_xdp_prog_load(struct net_device *dev, int map)
+{
+    struct bpf_insn insns[] = {
+        { .code = BPF_LDX | BPF_MEM | BPF_W, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index) },
+        { .code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD, .imm = map },
+        { .code = 0 }, /* second half of the 64bit immediate */
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    static const char license[] = "Dual MIT/GPL";
+    union bpf_attr attr = {};
+    int prog;
+
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t)insns;
+    attr.insn_cnt = countof(insns);
+    attr.license = (uintptr_t)license;
+    prog = ether_xdp_bpf(BPF_PROG_LOAD, &attr);
+    if (prog == -1) {
+        errorf("bpf(BPF_PROG_LOAD): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return prog;
+}
+
+static int
+ether_xdp_prog_attach(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    union bpf_attr attr = {};
+    uint32_t key = ETHER_XDP_QUEUE_ID, value;
+
+    xdp = PRIV(dev);
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(key);
+    attr.value_size = sizeof(value);
+    attr.max_entries = ETHER_XDP_QUEUE_ID + 1;
+    xdp->map = ether_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (xdp->map == -1) {
+        errorf("bpf(BPF_MAP_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    value = xdp->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->map;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&value;
+    if (ether_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        errorf("bpf(BPF_MAP_UPDATE_ELEM): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    xdp->prog = ether_xdp_prog_load(dev, xdp->map);
+    if (xdp->prog == -1) {
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->prog;
+    attr.link_create.target_ifindex = if_nametoindex(xdp->name);
+    attr.link_create.attach_type = BPF_XDP;
+    xdp->link = ether_xdp_bpf(BPF_LINK_CREATE, &attr);
+    if (xdp->link == -1) {
+        errorf("bpf(BPF_LINK_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ether_xdp_ring_map(struct net_device *dev, struct ether_xdp_ring *ring, struct xdp_ring_offset *off, size_t entry, off_t pgoff)
+{
+    uint8_t *map;
+
+    ring->size = off->desc + ETHER_XDP_RING_SIZE * entry;
+    map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, PRIV(dev)->fd, pgoff);
+    if (map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ring->map = map;
+    ring->producer = (uint32_t *)(map + off->producer);
+    ring->consumer = (uint32_t *)(map + off->consumer);
+    ring->flags = (uint32_t *)(map + off->flags);
+    ring->ring = map + off->desc;
+    return 0;
+}
+
+static void
+ether_xdp_ring_unmap(struct ether_xdp_ring *ring)
+{
+    if (ring->map) {
+        munmap(ring->map, ring->size);
+        ring->map = NULL;
+    }
+}
+
+static int
+ether_xdp_socket(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    struct xdp_umem_reg reg = {};
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr = {};
+    socklen_t optlen;
+    int size = ETHER_XDP_RING_SIZE;
+    uint64_t *fill;
+    unsigned int i;
+
+    xdp = PRIV(dev);
+    xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xdp->fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    xdp->umem = mmap(NULL, ETHER_XDP_FRAME_NUM * ETHER_XDP_FRAME_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (xdp->umem == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        xdp->umem = NULL;
+        return -1;
+    }
+    reg.addr = (uintptr_t)xdp->umem;
+    reg.len = ETHER_XDP_FRAME_NUM * ETHER_XDP_FRAME_SIZE;
+    reg.chunk_size = ETHER_XDP_FRAME_SIZE;
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+        errorf("setsockopt(XDP_UMEM_REG): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1) {
+        errorf("setsockopt: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    optlen = sizeof(off);
+    if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+        errorf("getsockopt(XDP_MMAP_OFFSETS): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_xdp_ring_map(dev, &xdp->fill, &off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->comp, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) == -1 ||
+        ether_xdp_ring_map(dev, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) == -1) {
+        return -1;
+    }
+    /* RX: hand the first half of UMEM to the kernel */
+    fill = xdp->fill.ring;
+    for (i = 0; i < ETHER_XDP_RING_SIZE; i++) {
+        fill[i] = (uint64_t)i * ETHER_XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(xdp->fill.producer, ETHER_XDP_RING_SIZE, __ATOMIC_RELEASE);
+    /* TX: the second half is ours */
+    for (i = 0; i < ETHER_XDP_RING_SIZE; i++) {
+        xdp->free[i] = (uint64_t)(ETHER_XDP_RING_SIZE + i) * ETHER_XDP_FRAME_SIZE;
+    }
+    xdp->nfree = ETHER_XDP_RING_SIZE;
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = if_nametoindex(xdp->name);
+    addr.sxdp_queue_id = ETHER_XDP_QUEUE_ID;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP;
+    addr.sxdp_flags |= (xdp->mode == ETHER_XDP_MODE_ZEROCOPY) ? XDP_ZEROCOPY : XDP_COPY;
+    if (bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        errorf("bind: %s, dev=%s, mode=%s", strerror(errno), dev->name, xdp->mode == ETHER_XDP_MODE_ZEROCOPY ? "zerocopy" : "copy");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ether_xdp_rx(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    uint64_t *fill;
+    uint32_t prod, cons, fprod;
+    int count = 0;
+
+    xdp = PRIV(dev);
+    prod = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    cons = *xdp->rx.consumer;
+    /* NOTE: the fill ring can always take them back (RX frames never exceed its size) */
+    fprod = *xdp->fill.producer;
+    fill = xdp->fill.ring;
+    for (; cons != prod; cons++, fprod++) {
+        desc = (struct xdp_desc *)xdp->rx.ring + (cons & (ETHER_XDP_RING_SIZE - 1));
+        ether_input_helper(dev, xdp->umem + desc->addr, desc->len, 0);
+        fill[fprod & (ETHER_XDP_RING_SIZE - 1)] = desc->addr & ~((uint64_t)ETHER_XDP_FRAME_SIZE - 1);
+        count++;
+    }
+    if (count) {
+        __atomic_store_n(xdp->rx.consumer, cons, __ATOMIC_RELEASE);
+        __atomic_store_n(xdp->fill.producer, fprod, __ATOMIC_RELEASE);
+    }
+    return count;
+}
+
+static void *
+ether_xdp_thread(void *arg)
+{
+    struct net_device *dev;
+    struct pollfd pfds[2];
+
+    dev = (struct net_device *)arg;
+    pfds[0].fd = PRIV(dev)->fd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = PRIV(dev)->event;
+    pfds[1].events = POLLIN;
+    while (1) {
+        if (ether_xdp_rx(dev)) {
+            continue;
+        }
+        /* NOTE: poll() also wakes up the kernel when the fill ring needs it */
+        if (poll(pfds, countof(pfds), -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+            break;
+        }
+        if (pfds[1].revents & POLLIN) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static int
+ether_xdp_close(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+
+    xdp = PRIV(dev);
+    if (xdp->running) {
+        eventfd_write(xdp->event, 1);
+        pthread_join(xdp->thread, NULL);
+        xdp->running = 0;
+    }
+    if (xdp->event != -1) {
+        close(xdp->event);
+        xdp->event = -1;
+    }
+    if (xdp->link != -1) {
+        close(xdp->link);
+        xdp->link = -1;
+    }
+    if (xdp->prog != -1) {
+        close(xdp->prog);
+        xdp->prog = -1;
+    }
+    if (xdp->map != -1) {
+        close(xdp->map);
+        xdp->map = -1;
+    }
+    ether_xdp_ring_unmap(&xdp->fill);
+    ether_xdp_ring_unmap(&xdp->comp);
+    ether_xdp_ring_unmap(&xdp->rx);
+    ether_xdp_ring_unmap(&xdp->tx);
+    if (xdp->fd != -1) {
+        close(xdp->fd);
+        xdp->fd = -1;
+    }
+    if (xdp->umem) {
+        munmap(xdp->umem, ETHER_XDP_FRAME_NUM * ETHER_XDP_FRAME_SIZE);
+        xdp->umem = NULL;
+    }
+    return 0;
+}
+
+static int
+ether_xdp_open(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    int err;
+
+    xdp = PRIV(dev);
+    /* NOTE: a frame must fit in a UMEM chunk (no multi-buffer) */
+    if (dev->hlen + dev->mtu > ETHER_XDP_FRAME_SIZE) {
+        errorf("jumbo frames are not supported, dev=%s, mtu=%u", dev->name, dev->mtu);
+        return -1;
+    }
+    if (!if_nametoindex(xdp->name)) {
+        errorf("if_nametoindex: %s, dev=%s, name=%s", strerror(errno), dev->name, xdp->name);
+        return -1;
+    }
+    if (ether_xdp_socket(dev) == -1 || ether_xdp_prog_attach(dev) == -1) {
+        ether_xdp_close(dev);
+        return -1;
+    }
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        if (ether_xdp_addr(dev) == -1) {
+            errorf("ether_xdp_addr() failure, dev=%s", dev->name);
+            ether_xdp_close(dev);
+            return -1;
+        }
+    }
+    xdp->event = eventfd(0, 0);
+    if (xdp->event == -1) {
+        errorf("eventfd: %s, dev=%s", strerror(errno), dev->name);
+        ether_xdp_close(dev);
+        return -1;
+    }
+    err = pthread_create(&xdp->thread, NULL, ether_xdp_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        ether_xdp_close(dev);
+        return -1;
+    }
+    xdp->running = 1;
+    debugf("dev=%s, mode=%s", dev->name, xdp->mode == ETHER_XDP_MODE_ZEROCOPY ? "zerocopy" : "copy");
+    return 0;
+}
+
+static void
+ether_xdp_reclaim(struct ether_xdp *xdp)
+{
+    uint64_t *comp;
+    uint32_t prod, cons;
+
+    prod = __atomic_load_n(xdp->comp.producer, __ATOMIC_ACQUIRE);
+    cons = *xdp->comp.consumer;
+    comp = xdp->comp.ring;
+    for (; cons != prod; cons++) {
+        xdp->free[xdp->nfree++] = comp[cons & (ETHER_XDP_RING_SIZE - 1)];
+    }
+    __atomic_store_n(xdp->comp.consumer, cons, __ATOMIC_RELEASE);
+}
+
+static ssize_t
+ether_xdp_writev(struct net_device *dev, const struct iovec *iov, int iovcnt)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    uint32_t prod;
+    size_t flen;
+
+    flen = iovec_len(iov, iovcnt);
+    xdp = PRIV(dev);
+    if (flen > ETHER_XDP_FRAME_SIZE) {
+        errorf("too long, dev=%s, len=%zu", dev->name, flen);
+        return -1;
+    }
+    mutex_lock(&xdp->mutex);
+    ether_xdp_reclaim(xdp);
+    if (!xdp->nfree) {
+        mutex_unlock(&xdp->mutex);
+        errorf("no free frame, dev=%s", dev->name);
+        return -1;
+    }
+    /* NOTE: the TX ring can always take it (TX frames never exceed its size) */
+    prod = *xdp->tx.producer;
+    desc = (struct xdp_desc *)xdp->tx.ring + (prod & (ETHER_XDP_RING_SIZE - 1));
+    desc->addr = xdp->free[--xdp->nfree];
+    desc->len = flen;
+    desc->options = 0;
+    iovec_gather(xdp->umem + desc->addr, flen, iov, iovcnt);
+    __atomic_store_n(xdp->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(xdp->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP) {
+        if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+            if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+                errorf("sendto: %s, dev=%s", strerror(errno), dev->name);
+            }
+        }
+    }
+    mutex_unlock(&xdp->mutex);
+    return flen;
+}
+
+int
+ether_xdp_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    return ether_transmit_iov_helper(dev, type, iov, iovcnt, dst, ether_xdp_writev);
+}
+
+static struct net_device_ops ether_xdp_ops = {
+    .open = ether_xdp_open,
+    .close = ether_xdp_close,
+    .transmit_iov = ether_xdp_transmit_iov,
+};
+
+struct net_device *
+ether_xdp_init(const char *name, const char *addr)
+{
+    struct net_device *dev;
+    struct ether_xdp *xdp;
+
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_xdp_ops;
+    xdp = memory_alloc(sizeof(*xdp));
+    if (!xdp) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(xdp->name, name, sizeof(xdp->name)-1);
+    xdp->mode = ETHER_XDP_MODE_COPY;
+    xdp->fd = -1;
+    xdp->map = -1;
+    xdp->prog = -1;
+    xdp->link = -1;
+    xdp->event = -1;
+    mutex_init(&xdp->mutex);
+    dev->priv = xdp;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(xdp);
+        return NULL;
+    }
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ether_xdp_set_mode(struct net_device *dev, int mode)
+{
+    if (dev->ops != &ether_xdp_ops) {
+        errorf("not a xdp device, dev=%s", dev->name);
+        return -1;
+    }
+    if (mode != ETHER_XDP_MODE_COPY && mode != ETHER_XDP_MODE_ZEROCOPY) {
+        errorf("invalid mode, dev=%s, mode=%d", dev->name, mode);
+        return -1;
+    }
+    PRIV(dev)->mode = mode;
+    debugf("dev=%s, mode=%s", dev->name, mode == ETHER_XDP_MODE_ZEROCOPY ? "zerocopy" : "copy");
+    return 0;
+}
@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/pcap_replay.h"
+
+#define PCAP_MAGIC      0xa1b2c3d4 /* timestamps in usec */
+#define PCAP_MAGIC_NSEC 0xa1b23c4d /* timestamps in nsec */
+
+#define PCAP_LINKTYPE_ETHERNET 1
+
+#define PCAP_REPLAY_SLEEP_MAX 100000000 /* nsec, to notice the stop request */
+
+struct pcap_file_hdr {
+    uint32_t magic;
+    uint16_t major;
+    uint16_t minor;
+    int32_t zone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+    uint32_t sec;
+    uint32_t frac; /* usec or nsec */
+    uint32_t caplen;
+    uint32_t len;
+};
+
+struct pcap_replay {
+    char file[PATH_MAX];
+    int mode;
+    unsigned int speed; /* percent */
+    /* input */
+    uint8_t *map;
+    size_t size;
+    size_t off; /* next record */
+    int swap; /* byte order of the file differs from ours */
+    int nsec;
+    /* output */
+    FILE *out;
+    mutex_t mutex; /* for out */
+    /* statistics */
+    size_t frames;
+    size_t bytes;
+    int running;
+    pthread_t thread;
+};
+
+#define PRIV(x) ((struct pcap_replay *)x->priv)
+
+static uint32_t
+pcap_replay_u32(struct pcap_replay *replay, uint32_t v)
+{
+    if (!replay->swap) {
+        return v;
+    }
+    return (v & 0x000000ff) << 24 | (v & 0x0000ff00) << 8 | (v & 0x00ff0000) >> 8 | (v & 0xff000000) >> 24;
+}
+
+static uint64_t
+pcap_replay_rec_nsec(struct pcap_replay *replay, const struct pcap_rec_hdr *rec)
+{
+    uint64_t frac;
+
+    frac = pcap_replay_u32(replay, rec->frac);
+    return (uint64_t)pcap_replay_u32(replay, rec->sec) * 1000000000 + (replay->nsec ? frac : frac * 1000);
+}
+
+static uint64_t
+pcap_replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* NOTE: returns -1 while the stop is requested */
+static int
+pcap_replay_sleep_until(struct pcap_replay *replay, uint64_t due)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    while (__atomic_load_n(&replay->running, __ATOMIC_ACQUIRE)) {
+        now = pcap_replay_now();
+        if (now >= due) {
+            return 0;
+        }
+        ts.tv_sec = 0;
+        ts.tv_nsec = MIN(due - now, PCAP_REPLAY_SLEEP_MAX);
+        nanosleep(&ts, NULL);
+    }
+    return -1;
+}
+
+static ssize_t
+pcap_replay_read(struct net_device *dev, uint8_t *buf, size_t size)
+{
+    struct pcap_replay *replay;
+    struct pcap_rec_hdr *rec;
+    size_t caplen;
+
+    replay = PRIV(dev);
+    rec = (struct pcap_rec_hdr *)(replay->map + replay->off);
+    caplen = pcap_replay_u32(replay, rec->caplen);
+    replay->off += sizeof(*rec) + caplen;
+    if (caplen > size) {
+        errorf("too long, dev=%s, len=%zu", dev->name, caplen);
+        return -1;
+    }
+    memcpy(buf, rec + 1, caplen);
+    replay->frames++;
+    replay->bytes += caplen;
+    return caplen;
+}
+
+static void *
+pcap_replay_thread(void *arg)
+{
+    struct net_device *dev;
+    struct pcap_replay *replay;
+    struct pcap_rec_hdr *rec;
+    uint64_t first = 0, start, ts, due, elapsed;
+
+    dev = (struct net_device *)arg;
+    replay = PRIV(dev);
+    start = pcap_replay_now();
+    while (replay->off + sizeof(*rec) <= replay->size) {
+        rec = (struct pcap_rec_hdr *)(replay->map + replay->off);
+        if (replay->off + sizeof(*rec) + pcap_replay_u32(replay, rec->caplen) > replay->size) {
+            errorf("truncated record, dev=%s, offset=%zu", dev->name, replay->off);
+            break;
+        }
+        if (replay->mode != PCAP_REPLAY_MODE_FAST) {
+            ts = pcap_replay_rec_nsec(replay, rec);
+            if (!first) {
+                first = ts;
+            }
+            due = ts - first;
+            if (replay->mode == PCAP_REPLAY_MODE_SCALED) {
+                due = due * 100 / replay->speed;
+            }
+            if (pcap_replay_sleep_until(replay, start + due) == -1) {
+                break;
+            }
+        } else if (!__atomic_load_n(&replay->running, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        ether_poll_helper(dev, pcap_replay_read);
+    }
+    elapsed = pcap_replay_now() - start;
+    infof("replay finished, dev=%s, frames=%zu, bytes=%zu, elapsed=%lu.%06lu, pps=%lu",
+        dev->name, replay->frames, replay->bytes,
+        (unsigned long)(elapsed / 1000000000), (unsigned long)(elapsed % 1000000000 / 1000),
+        (unsigned long)(elapsed ? replay->frames * 1000000000 / elapsed : 0));
+    return NULL;
+}
+
+static int
+pcap_replay_load(struct net_device *dev)
+{
+    struct pcap_replay *replay;
+    struct pcap_file_hdr *hdr;
+    struct stat st;
+    int fd;
+
+    replay = PRIV(dev);
+    fd = open(replay->file, O_RDONLY);
+    if (fd == -1) {
+        errorf("open: %s, dev=%s, file=%s", strerror(errno), dev->name, replay->file);
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        errorf("fstat: %s, dev=%s", strerror(errno), dev->name);
+        close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        errorf("too short, dev=%s, file=%s", dev->name, replay->file);
+        close(fd);
+        return -1;
+    }
+    replay->size = st.st_size;
+    replay->map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (replay->map == MAP_FAILED) {
+        errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        replay->map = NULL;
+        return -1;
+    }
+    /* NOTE: read once from head to tail */
+    madvise(replay->map, replay->size, MADV_SEQUENTIAL);
+    hdr = (struct pcap_file_hdr *)replay->map;
+    switch (hdr->magic) {
+    case PCAP_MAGIC:
+    case PCAP_MAGIC_NSEC:
+        replay->swap = 0;
+        break;
+    default:
+        replay->swap = 1;
+        break;
+    }
+    switch (pcap_replay_u32(replay, hdr->magic)) {
+    case PCAP_MAGIC:
+        replay->nsec = 0;
+        break;
+    case PCAP_MAGIC_NSEC:
+        replay->nsec = 1;
+        break;
+    default:
+        errorf("not a pcap file, dev=%s, file=%s", dev->name, replay->file);
+        return -1;
+    }
+    if (pcap_replay_u32(replay, hdr->linktype) != PCAP_LINKTYPE_ETHERNET) {
+        errorf("unsupported linktype, dev=%s, linktype=%u", dev->name, pcap_replay_u32(replay, hdr->linktype));
+        return -1;
+    }
+    replay->off = sizeof(*hdr);
+    return 0;
+}
+
+/* NOTE: take over the address of the captured host (the first unicast destination) */
+static void
+pcap_replay_addr(struct net_device *dev)
+{
+    struct pcap_replay *replay;
+    struct pcap_rec_hdr *rec;
+    size_t off;
+
+    replay = PRIV(dev);
+    for (off = replay->off; off + sizeof(*rec) <= replay->size; off += sizeof(*rec) + pcap_replay_u32(replay, rec->caplen)) {
+        rec = (struct pcap_rec_hdr *)(replay->map + off);
+        if (pcap_replay_u32(replay, rec->caplen) < ETHER_HDR_SIZE || off + sizeof(*rec) + ETHER_HDR_SIZE > replay->size) {
+            break;
+        }
+        if (!(((uint8_t *)(rec + 1))[0] & 0x01)) {
+            memcpy(dev->addr, rec + 1, ETHER_ADDR_LEN);
+            return;
+        }
+    }
+}
+
+static int
+pcap_replay_close(struct net_device *dev)
+{
+    struct pcap_replay *replay;
+
+    replay = PRIV(dev);
+    if (replay->running) {
+        __atomic_store_n(&replay->running, 0, __ATOMIC_RELEASE);
+        pthread_join(replay->thread, NULL);
+    }
+    if (replay->map) {
+        munmap(replay->map, replay->size);
+        replay->map = NULL;
+    }
+    if (replay->out) {
+        fclose(replay->out);
+        replay->out = NULL;
+    }
+    return 0;
+}
+
+static int
+pcap_replay_open(struct net_device *dev)
+{
+    struct pcap_replay *replay;
+    int err;
+
+    replay = PRIV(dev);
+    if (pcap_replay_load(dev) == -1) {
+        pcap_replay_close(dev);
+        return -1;
+    }
+    if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
+        pcap_replay_addr(dev);
+    }
+    replay->running = 1;
+    err = pthread_create(&replay->thread, NULL, pcap_replay_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        replay->running = 0;
+        pcap_replay_close(dev);
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t
+pcap_replay_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+{
+    struct pcap_replay *replay;
+    struct pcap_rec_hdr rec;
+    struct timeval now;
+
+    replay = PRIV(dev);
+    if (!replay->out) {
+        /* drop */
+        return flen;
+    }
+    gettimeofday(&now, NULL);
+    rec.sec = now.tv_sec;
+    rec.frac = now.tv_usec;
+    rec.caplen = rec.len = flen;
+    mutex_lock(&replay->mutex);
+    fwrite(&rec, sizeof(rec), 1, replay->out);
+    fwrite(frame, flen, 1, replay->out);
+    mutex_unlock(&replay->mutex);
+    return flen;
+}
+
+int
+pcap_replay_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+{
+    return ether_transmit_helper(dev, type, buf, len, dst, pcap_replay_write);
+}
+
+static struct net_device_ops pcap_replay_ops = {
+    .open = pcap_replay_open,
+    .close = pcap_replay_close,
+    .transmit = pcap_replay_transmit,
+};
+
+struct net_device *
+pcap_replay_init(const char *file, const char *addr)
+{
+    struct net_device *dev;
+    struct pcap_replay *replay;
+
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &pcap_replay_ops;
+    replay = memory_alloc(sizeof(*replay));
+    if (!replay) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(replay->file, file, sizeof(replay->file)-1);
+    replay->mode = PCAP_REPLAY_MODE_ORIGINAL;
+    replay->speed = 100;
+    mutex_init(&replay->mutex);
+    dev->priv = replay;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(replay);
+        return NULL;
+    }
+    debugf("ethernet device initialized, dev=%s, file=%s", dev->name, file);
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+pcap_replay_set_mode(struct net_device *dev, int mode, unsigned int speed)
+{
+    if (dev->ops != &pcap_replay_ops) {
+        errorf("not a replay device, dev=%s", dev->name);
+        return -1;
+    }
+    if (mode != PCAP_REPLAY_MODE_ORIGINAL && mode != PCAP_REPLAY_MODE_SCALED && mode != PCAP_REPLAY_MODE_FAST) {
+        errorf("invalid mode, dev=%s, mode=%d", dev->name, mode);
+        return -1;
+    }
+    if (mode == PCAP_REPLAY_MODE_SCALED && !speed) {
+        errorf("invalid speed, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->mode = mode;
+    PRIV(dev)->speed = speed;
+    debugf("dev=%s, mode=%d, speed=%u%%", dev->name, mode, speed);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+pcap_replay_set_output(struct net_device *dev, const char *file)
+{
+    struct pcap_replay *replay;
+    struct pcap_file_hdr hdr = {};
+
+    if (dev->ops != &pcap_replay_ops) {
+        errorf("not a replay device, dev=%s", dev->name);
+        return -1;
+    }
+    replay = PRIV(dev);
+    if (replay->out) {
+        fclose(replay->out);
+    }
+    replay->out = fopen(file, "w");
+    if (!replay->out) {
+        errorf("fopen: %s, dev=%s, file=%s", strerror(errno), dev->name, file);
+        return -1;
+    }
+    hdr.magic = PCAP_MAGIC;
+    hdr.major = 2;
+    hdr.minor = 4;
+    hdr.snaplen = ETHER_JUMBO_FRAME_SIZE_MAX;
+    hdr.linktype = PCAP_LINKTYPE_ETHERNET;
+    fwrite(&hdr, sizeof(hdr), 1, replay->out);
+    debugf("dev=%s, output=%s", dev->name, file);
+    return 0;
+}
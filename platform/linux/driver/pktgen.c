@@ -0,0 +1,551 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "icmp.h"
+
+#include "driver/pktgen.h"
+
+#define PKTGEN_MTU 1500 /* same as ethernet, the stack sees realistic segment sizes */
+
+#define PKTGEN_L4_HDR_SIZE_MAX 20 /* TCP without options */
+#define PKTGEN_PAYLOAD_SIZE_MAX (PKTGEN_MTU - IP_HDR_SIZE_MIN - PKTGEN_L4_HDR_SIZE_MAX)
+#define PKTGEN_PAYLOAD_SIZE_DEFAULT 18 /* 64 bytes on ethernet for UDP */
+
+#define PKTGEN_SLEEP_MAX 100000000 /* nsec, to notice the stop request */
+#define PKTGEN_BACKLOG_MAX 256 /* packets in flight (injected but not yet handled) without a rate */
+#define PKTGEN_BACKLOG_WAIT 10000 /* nsec */
+
+/* NOTE: placed at the head of the payload, echoed payloads give the latency */
+#define PKTGEN_MARKER_MAGIC 0x504b5447 /* "PKTG" */
+#define PKTGEN_MARKER_SIZE 12 /* magic (4) + timestamp in nsec (8) */
+#define PKTGEN_HEAD_SIZE_MAX (IP_HDR_SIZE_MAX + 60 + PKTGEN_MARKER_SIZE) /* longest headers (IP + TCP) and the marker */
+
+#define PKTGEN_TCP_FLG_PSH 0x08
+#define PKTGEN_TCP_FLG_ACK 0x10
+
+struct pktgen_ip_hdr {
+    uint8_t vhl;
+    uint8_t tos;
+    uint16_t total;
+    uint16_t id;
+    uint16_t offset;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t sum;
+    ip_addr_t src;
+    ip_addr_t dst;
+};
+
+struct pktgen_pseudo_hdr {
+    uint32_t src;
+    uint32_t dst;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t len;
+};
+
+struct pktgen_icmp_hdr {
+    uint8_t type;
+    uint8_t code;
+    uint16_t sum;
+    uint16_t id;
+    uint16_t seq;
+};
+
+struct pktgen_udp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint16_t sum;
+};
+
+struct pktgen_tcp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t off;
+    uint8_t flg;
+    uint16_t wnd;
+    uint16_t sum;
+    uint16_t up;
+};
+
+struct pktgen {
+    /* flow */
+    uint8_t protocol; /* 0: not configured */
+    struct ip_endpoint src;
+    struct ip_endpoint dst;
+    int random;
+    size_t min;
+    size_t max;
+    unsigned long pps; /* 0: as fast as possible */
+    unsigned long count; /* 0: unlimited */
+    uint32_t seed;
+    /* statistics */
+    struct pktgen_stats stats;
+    uint64_t start;
+    int running;
+    pthread_t thread;
+};
+
+#define PRIV(x) ((struct pktgen *)x->priv)
+
+static uint64_t
+pktgen_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* NOTE: returns -1 while the stop is requested */
+static int
+pktgen_sleep_until(struct pktgen *gen, uint64_t due)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    while (__atomic_load_n(&gen->running, __ATOMIC_ACQUIRE)) {
+        now = pktgen_now();
+        if (now >= due) {
+            return 0;
+        }
+        ts.tv_sec = 0;
+        ts.tv_nsec = MIN(due - now, PKTGEN_SLEEP_MAX);
+        nanosleep(&ts, NULL);
+    }
+    return -1;
+}
+
+/* NOTE: returns -1 while the stop is requested */
+static int
+pktgen_wait_backlog(struct net_device *dev, unsigned int limit)
+{
+    struct pktgen *gen;
+
+    gen = PRIV(dev);
+    while (__atomic_load_n(&dev->backlog, __ATOMIC_ACQUIRE) > limit) {
+        if (pktgen_sleep_until(gen, pktgen_now() + PKTGEN_BACKLOG_WAIT) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* xorshift32 */
+static uint32_t
+pktgen_random(struct pktgen *gen)
+{
+    uint32_t x = gen->seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    gen->seed = x;
+    return x;
+}
+
+static uint16_t
+pktgen_l4_cksum(const struct pktgen_ip_hdr *ip, const uint8_t *l4, size_t len)
+{
+    struct pktgen_pseudo_hdr pseudo;
+    uint16_t psum;
+
+    pseudo.src = ip->src;
+    pseudo.dst = ip->dst;
+    pseudo.zero = 0;
+    pseudo.protocol = ip->protocol;
+    pseudo.len = hton16(len);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    return cksum16((uint16_t *)l4, len, psum);
+}
+
+static size_t
+pktgen_build(struct pktgen *gen, uint8_t *buf, uint32_t seq)
+{
+    struct pktgen_ip_hdr *ip;
+    struct pktgen_icmp_hdr *icmp;
+    struct pktgen_udp_hdr *udp;
+    struct pktgen_tcp_hdr *tcp;
+    uint8_t *payload;
+    size_t hlen, plen, len;
+    uint16_t sport, dport;
+    uint32_t magic;
+    uint64_t now;
+
+    ip = (struct pktgen_ip_hdr *)buf;
+    ip->vhl = (IP_VERSION_IPV4 << 4) | (sizeof(*ip) >> 2);
+    ip->tos = 0;
+    ip->id = hton16(seq);
+    ip->offset = 0;
+    ip->ttl = 0xff;
+    ip->protocol = gen->protocol;
+    ip->sum = 0;
+    ip->src = gen->src.addr;
+    ip->dst = gen->dst.addr;
+    if (gen->random & PKTGEN_RANDOM_SRC_ADDR) {
+        ip->src = (ip->src & hton32(0xffffff00)) | hton32(pktgen_random(gen) % 254 + 1);
+    }
+    sport = gen->src.port;
+    if (gen->random & PKTGEN_RANDOM_SRC_PORT) {
+        sport = hton16(pktgen_random(gen) % 64512 + 1024);
+    }
+    dport = gen->dst.port;
+    if (gen->random & PKTGEN_RANDOM_DST_PORT) {
+        dport = hton16(pktgen_random(gen) % 64512 + 1024);
+    }
+    switch (gen->protocol) {
+    case IP_PROTOCOL_ICMP:
+        hlen = sizeof(*icmp);
+        break;
+    case IP_PROTOCOL_UDP:
+        hlen = sizeof(*udp);
+        break;
+    default:
+        hlen = sizeof(*tcp);
+        break;
+    }
+    plen = gen->min;
+    if (gen->max > gen->min) {
+        plen += pktgen_random(gen) % (gen->max - gen->min + 1);
+    }
+    len = hlen + plen;
+    payload = (uint8_t *)(ip + 1) + hlen;
+    memset(payload, 0, plen);
+    if (plen >= PKTGEN_MARKER_SIZE) {
+        magic = PKTGEN_MARKER_MAGIC;
+        now = pktgen_now();
+        memcpy(payload, &magic, sizeof(magic));
+        memcpy(payload + sizeof(magic), &now, sizeof(now));
+    }
+    switch (gen->protocol) {
+    case IP_PROTOCOL_ICMP:
+        icmp = (struct pktgen_icmp_hdr *)(ip + 1);
+        icmp->type = ICMP_TYPE_ECHO;
+        icmp->code = 0;
+        icmp->sum = 0;
+        icmp->id = sport;
+        icmp->seq = hton16(seq);
+        icmp->sum = cksum16((uint16_t *)icmp, len, 0);
+        break;
+    case IP_PROTOCOL_UDP:
+        udp = (struct pktgen_udp_hdr *)(ip + 1);
+        udp->src = sport;
+        udp->dst = dport;
+        udp->len = hton16(len);
+        udp->sum = 0;
+        udp->sum = pktgen_l4_cksum(ip, (uint8_t *)udp, len);
+        break;
+    default:
+        tcp = (struct pktgen_tcp_hdr *)(ip + 1);
+        tcp->src = sport;
+        tcp->dst = dport;
+        tcp->seq = hton32(pktgen_random(gen));
+        tcp->ack = hton32(pktgen_random(gen));
+        tcp->off = (sizeof(*tcp) >> 2) << 4;
+        tcp->flg = PKTGEN_TCP_FLG_ACK | PKTGEN_TCP_FLG_PSH;
+        tcp->wnd = hton16(65535);
+        tcp->sum = 0;
+        tcp->up = 0;
+        tcp->sum = pktgen_l4_cksum(ip, (uint8_t *)tcp, len);
+        break;
+    }
+    ip->total = hton16(sizeof(*ip) + len);
+    ip->sum = cksum16((uint16_t *)ip, sizeof(*ip), 0);
+    return sizeof(*ip) + len;
+}
+
+static void *
+pktgen_thread(void *arg)
+{
+    struct net_device *dev;
+    struct pktgen *gen;
+    uint8_t buf[PKTGEN_MTU];
+    unsigned long n, processed;
+    uint64_t elapsed, tx;
+    size_t len;
+
+    dev = (struct net_device *)arg;
+    gen = PRIV(dev);
+    for (n = 0; !gen->count || n < gen->count; n++) {
+        if (gen->pps) {
+            if (pktgen_sleep_until(gen, gen->start + (uint64_t)n * 1000000000 / gen->pps) == -1) {
+                break;
+            }
+        } else if (pktgen_wait_backlog(dev, PKTGEN_BACKLOG_MAX - 1) == -1) {
+            /* NOTE: the input queue is unbounded, keep it from growing faster than the stack drains it */
+            break;
+        }
+        len = pktgen_build(gen, buf, n);
+        if (net_input_handler(NET_PROTOCOL_TYPE_IP, buf, len, dev, 0) == -1) {
+            break;
+        }
+        __atomic_add_fetch(&gen->stats.rx_packets, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&gen->stats.rx_bytes, len, __ATOMIC_RELAXED);
+    }
+    /* NOTE: the rate is what the stack has handled, not what has been injected */
+    pktgen_wait_backlog(dev, 0);
+    elapsed = pktgen_now() - gen->start;
+    processed = n - __atomic_load_n(&dev->backlog, __ATOMIC_ACQUIRE);
+    tx = __atomic_load_n(&gen->stats.tx_packets, __ATOMIC_RELAXED);
+    infof("generation finished, dev=%s, packets=%lu, processed=%lu, elapsed=%lu.%06lu, pps=%lu, tx=%lu",
+        dev->name, n, processed,
+        (unsigned long)(elapsed / 1000000000), (unsigned long)(elapsed % 1000000000 / 1000),
+        (unsigned long)(elapsed ? (uint64_t)processed * 1000000000 / elapsed : 0), (unsigned long)tx);
+    return NULL;
+}
+
+static int
+pktgen_close(struct net_device *dev)
+{
+    struct pktgen *gen;
+    struct pktgen_stats stats;
+
+    gen = PRIV(dev);
+    if (gen->running) {
+        __atomic_store_n(&gen->running, 0, __ATOMIC_RELEASE);
+        pthread_join(gen->thread, NULL);
+        pktgen_get_stats(dev, &stats);
+        infof("dev=%s, rx=%lu (%lu bytes), processed=%lu, tx=%lu (%lu bytes), latency: avg=%luns, max=%luns",
+            dev->name, (unsigned long)stats.rx_packets, (unsigned long)stats.rx_bytes, (unsigned long)stats.processed,
+            (unsigned long)stats.tx_packets, (unsigned long)stats.tx_bytes,
+            (unsigned long)(stats.latency_count ? stats.latency_sum / stats.latency_count : 0), (unsigned long)stats.latency_max);
+    }
+    return 0;
+}
+
+static int
+pktgen_open(struct net_device *dev)
+{
+    struct pktgen *gen;
+    int err;
+
+    gen = PRIV(dev);
+    if (!gen->protocol) {
+        errorf("flow is not configured, dev=%s", dev->name);
+        return -1;
+    }
+    memset(&gen->stats, 0, sizeof(gen->stats));
+    gen->seed = pktgen_now() | 1;
+    gen->start = pktgen_now();
+    gen->running = 1;
+    err = pthread_create(&gen->thread, NULL, pktgen_thread, dev);
+    if (err) {
+        errorf("pthread_create() %s, dev=%s", strerror(err), dev->name);
+        gen->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: returns the offset of the payload, or -1 for unknown packets */
+static ssize_t
+pktgen_payload(const uint8_t *data, size_t len)
+{
+    size_t hlen;
+
+    if (len < IP_HDR_SIZE_MIN) {
+        return -1;
+    }
+    hlen = (data[0] & 0x0f) << 2;
+    switch (data[9]) {
+    case IP_PROTOCOL_ICMP:
+        hlen += sizeof(struct pktgen_icmp_hdr);
+        break;
+    case IP_PROTOCOL_UDP:
+        hlen += sizeof(struct pktgen_udp_hdr);
+        break;
+    case IP_PROTOCOL_TCP:
+        if (len < hlen + sizeof(struct pktgen_tcp_hdr)) {
+            return -1;
+        }
+        hlen += (data[hlen+12] >> 4) << 2;
+        break;
+    default:
+        return -1;
+    }
+    return hlen;
+}
+
+static int
+pktgen_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    struct pktgen *gen;
+    uint8_t data[PKTGEN_HEAD_SIZE_MAX];
+    size_t len;
+    ssize_t off;
+    uint32_t magic;
+    uint64_t ts, now, latency, max;
+
+    gen = PRIV(dev);
+    __atomic_add_fetch(&gen->stats.tx_packets, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gen->stats.tx_bytes, iovec_len(iov, iovcnt), __ATOMIC_RELAXED);
+    if (type != NET_PROTOCOL_TYPE_IP) {
+        return 0;
+    }
+    /* NOTE: only the headers and the marker are looked at, the rest is never copied */
+    len = iovec_gather(data, sizeof(data), iov, iovcnt);
+    off = pktgen_payload(data, len);
+    if (off == -1 || len < (size_t)off + PKTGEN_MARKER_SIZE) {
+        return 0;
+    }
+    memcpy(&magic, data + off, sizeof(magic));
+    if (magic != PKTGEN_MARKER_MAGIC) {
+        return 0;
+    }
+    memcpy(&ts, data + off + sizeof(magic), sizeof(ts));
+    now = pktgen_now();
+    if (now < ts) {
+        return 0;
+    }
+    latency = now - ts;
+    __atomic_add_fetch(&gen->stats.latency_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&gen->stats.latency_sum, latency, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&gen->stats.latency_max, __ATOMIC_RELAXED);
+    while (latency > max) {
+        if (__atomic_compare_exchange_n(&gen->stats.latency_max, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    /* drop data */
+    return 0;
+}
+
+static struct net_device_ops pktgen_ops = {
+    .open = pktgen_open,
+    .close = pktgen_close,
+    .transmit_iov = pktgen_transmit_iov,
+};
+
+static void
+pktgen_setup(struct net_device *dev)
+{
+    dev->type = NET_DEVICE_TYPE_NULL;
+    dev->mtu = PKTGEN_MTU;
+    dev->hlen = 0; /* non header */
+    dev->alen = 0; /* non address */
+    /* NOTE: transmitted packets are discarded, no need to complete checksums */
+    dev->features = NET_DEVICE_FEATURE_CSUM_TX;
+    dev->ops = &pktgen_ops;
+}
+
+struct net_device *
+pktgen_init(void)
+{
+    struct net_device *dev;
+    struct pktgen *gen;
+
+    dev = net_device_alloc(pktgen_setup);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    gen = memory_alloc(sizeof(*gen));
+    if (!gen) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    gen->min = gen->max = PKTGEN_PAYLOAD_SIZE_DEFAULT;
+    dev->priv = gen;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(gen);
+        return NULL;
+    }
+    debugf("initialized, dev=%s", dev->name);
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+pktgen_set_flow(struct net_device *dev, uint8_t protocol, const char *src, const char *dst, int random)
+{
+    struct pktgen *gen;
+
+    if (dev->ops != &pktgen_ops) {
+        errorf("not a pktgen device, dev=%s", dev->name);
+        return -1;
+    }
+    gen = PRIV(dev);
+    if (protocol != IP_PROTOCOL_ICMP && protocol != IP_PROTOCOL_UDP && protocol != IP_PROTOCOL_TCP) {
+        errorf("unsupported protocol, dev=%s, protocol=%u", dev->name, protocol);
+        return -1;
+    }
+    if (ip_endpoint_pton(src, &gen->src) == -1) {
+        errorf("invalid source, dev=%s, src=%s", dev->name, src);
+        return -1;
+    }
+    if (ip_endpoint_pton(dst, &gen->dst) == -1) {
+        errorf("invalid destination, dev=%s, dst=%s", dev->name, dst);
+        return -1;
+    }
+    gen->protocol = protocol;
+    gen->random = random;
+    debugf("dev=%s, protocol=%u, src=%s, dst=%s, random=0x%04x", dev->name, protocol, src, dst, random);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+pktgen_set_size(struct net_device *dev, size_t min, size_t max)
+{
+    if (dev->ops != &pktgen_ops) {
+        errorf("not a pktgen device, dev=%s", dev->name);
+        return -1;
+    }
+    if (min > max || max > PKTGEN_PAYLOAD_SIZE_MAX) {
+        errorf("invalid size, dev=%s, min=%zu, max=%zu", dev->name, min, max);
+        return -1;
+    }
+    PRIV(dev)->min = min;
+    PRIV(dev)->max = max;
+    debugf("dev=%s, min=%zu, max=%zu", dev->name, min, max);
+    return 0;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+pktgen_set_rate(struct net_device *dev, unsigned long pps, unsigned long count)
+{
+    if (dev->ops != &pktgen_ops) {
+        errorf("not a pktgen device, dev=%s", dev->name);
+        return -1;
+    }
+    PRIV(dev)->pps = pps;
+    PRIV(dev)->count = count;
+    debugf("dev=%s, pps=%lu, count=%lu", dev->name, pps, count);
+    return 0;
+}
+
+int
+pktgen_get_stats(struct net_device *dev, struct pktgen_stats *stats)
+{
+    struct pktgen *gen;
+
+    if (dev->ops != &pktgen_ops) {
+        errorf("not a pktgen device, dev=%s", dev->name);
+        return -1;
+    }
+    gen = PRIV(dev);
+    stats->rx_packets = __atomic_load_n(&gen->stats.rx_packets, __ATOMIC_RELAXED);
+    stats->rx_bytes = __atomic_load_n(&gen->stats.rx_bytes, __ATOMIC_RELAXED);
+    stats->processed = stats->rx_packets - MIN(stats->rx_packets, __atomic_load_n(&dev->backlog, __ATOMIC_ACQUIRE));
+    stats->tx_packets = __atomic_load_n(&gen->stats.tx_packets, __ATOMIC_RELAXED);
+    stats->tx_bytes = __atomic_load_n(&gen->stats.tx_bytes, __ATOMIC_RELAXED);
+    stats->latency_count = __atomic_load_n(&gen->stats.latency_count, __ATOMIC_RELAXED);
+    stats->latency_sum = __atomic_load_n(&gen->stats.latency_sum, __ATOMIC_RELAXED);
+    stats->latency_max = __atomic_load_n(&gen->stats.latency_max, __ATOMIC_RELAXED);
+    stats->elapsed = gen->start ? pktgen_now() - gen->start : 0;
+    return 0;
+}
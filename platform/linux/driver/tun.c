@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <sys/uio.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/tun.h"
+#include "driver/ether_notify.h"
+
+#define CLONE_DEVICE "/dev/net/tun"
+
+#define TUN_IRQ (SIGRTMIN+4)
+
+#define TUN_MTU_DEFAULT 1500 /* replaced by the MTU of the host interface at open */
+#define TUN_MTU_MIN 68 /* minimum MTU of IPv4 (RFC 791) */
+
+struct tun {
+    char name[IFNAMSIZ];
+    int fd;
+    unsigned int irq;
+    uint16_t mtu; /* 0: follow the host interface */
+    struct ether_notify notify;
+};
+
+#define PRIV(x) ((struct tun *)x->priv)
+
+static int
+tun_mtu(struct net_device *dev)
+{
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (PRIV(dev)->mtu) {
+        ifr.ifr_mtu = PRIV(dev)->mtu;
+        if (ioctl(soc, SIOCSIFMTU, &ifr) == -1) {
+            errorf("ioctl(SIOCSIFMTU): %s, dev=%s", strerror(errno), dev->name);
+            close(soc);
+            return -1;
+        }
+    } else {
+        if (ioctl(soc, SIOCGIFMTU, &ifr) == -1) {
+            errorf("ioctl(SIOCGIFMTU): %s, dev=%s", strerror(errno), dev->name);
+            close(soc);
+            return -1;
+        }
+    }
+    close(soc);
+    if (ifr.ifr_mtu < TUN_MTU_MIN || ifr.ifr_mtu > IP_TOTAL_SIZE_MAX) {
+        errorf("invalid mtu, dev=%s, mtu=%d", dev->name, ifr.ifr_mtu);
+        return -1;
+    }
+    dev->mtu = ifr.ifr_mtu;
+    debugf("dev=%s, mtu=%u", dev->name, dev->mtu);
+    return 0;
+}
+
+static int
+tun_open(struct net_device *dev)
+{
+    struct tun *tun;
+    struct ifreq ifr = {};
+
+    tun = PRIV(dev);
+    tun->fd = open(CLONE_DEVICE, O_RDWR);
+    if (tun->fd == -1) {
+        errorf("open: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, tun->name, sizeof(ifr.ifr_name)-1);
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    if (ioctl(tun->fd, TUNSETIFF, &ifr) == -1) {
+        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    if (tun_mtu(dev) == -1) {
+        errorf("tun_mtu() failure, dev=%s", dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    if (ether_notify_open(&tun->notify, dev, tun->fd, tun->irq) == -1) {
+        errorf("ether_notify_open() failure, dev=%s", dev->name);
+        close(tun->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+tun_close(struct net_device *dev)
+{
+    ether_notify_close(&PRIV(dev)->notify);
+    close(PRIV(dev)->fd);
+    return 0;
+}
+
+/* NOTE: no link header, the packet goes to the host as it is */
+static int
+tun_transmit_iov(struct net_device *dev, uint16_t type, const struct iovec *iov, int iovcnt, const void *dst)
+{
+    if (type != NET_PROTOCOL_TYPE_IP) {
+        errorf("unsupported type, dev=%s, type=0x%04x", dev->name, type);
+        return -1;
+    }
+    debugf("dev=%s, len=%zu", dev->name, iovec_len(iov, iovcnt));
+    if (writev(PRIV(dev)->fd, iov, iovcnt) == -1) {
+        errorf("writev: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+tun_input(struct net_device *dev)
+{
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+    ssize_t len;
+
+    len = read(PRIV(dev)->fd, buf, dev->mtu);
+    if (len == -1) {
+        if (errno != EINTR && errno != EAGAIN) {
+            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+        }
+        return -1;
+    }
+    if (len < 1 || (buf[0] >> 4) != IP_VERSION_IPV4) {
+        /* NOTE: IPv6 packets from the host are not supported */
+        debugf("not an IPv4 packet, dev=%s, len=%zd", dev->name, len);
+        return 0;
+    }
+    debugf("dev=%s, len=%zd", dev->name, len);
+    return net_input_handler(NET_PROTOCOL_TYPE_IP, buf, len, dev, 0);
+}
+
+static int
+tun_isr(unsigned int irq, void *id)
+{
+    struct net_device *dev = (struct net_device *)id;
+    struct tun *tun;
+    struct pollfd pfd;
+    size_t frames;
+    int ret;
+
+    tun = PRIV(dev);
+    if (!ether_notify_begin(&tun->notify)) {
+        return 0;
+    }
+    pfd.fd = tun->fd;
+    pfd.events = POLLIN;
+    do {
+        frames = 0;
+        while (1) {
+            ret = poll(&pfd, 1, 0);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                errorf("poll: %s, dev=%s", strerror(errno), dev->name);
+                return -1;
+            }
+            if (ret == 0) {
+                break;
+            }
+            tun_input(dev);
+            frames++;
+        }
+    } while (ether_notify_complete(&tun->notify, frames));
+    return 0;
+}
+
+static struct net_device_ops tun_ops = {
+    .open = tun_open,
+    .close = tun_close,
+    .transmit_iov = tun_transmit_iov,
+};
+
+static void
+tun_setup(struct net_device *dev)
+{
+    dev->type = NET_DEVICE_TYPE_TUN;
+    dev->mtu = TUN_MTU_DEFAULT;
+    dev->hlen = 0; /* non header */
+    dev->alen = 0; /* non address */
+    dev->flags = NET_DEVICE_FLAG_P2P; /* no NET_DEVICE_FLAG_NEED_ARP */
+    dev->ops = &tun_ops;
+}
+
+struct net_device *
+tun_init(const char *name)
+{
+    struct net_device *dev;
+    struct tun *tun;
+
+    dev = net_device_alloc(tun_setup);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    tun = memory_alloc(sizeof(*tun));
+    if (!tun) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(tun->name, name, sizeof(tun->name)-1);
+    tun->fd = -1;
+    tun->irq = TUN_IRQ;
+    dev->priv = tun;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(tun);
+        return NULL;
+    }
+    intr_request_irq(tun->irq, tun_isr, NET_IRQ_SHARED, dev->name, dev);
+    debugf("tun device initialized, dev=%s", dev->name);
+    return dev;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+tun_set_mtu(struct net_device *dev, uint16_t mtu)
+{
+    if (dev->ops != &tun_ops) {
+        errorf("not a tun device, dev=%s", dev->name);
+        return -1;
+    }
+    if (mtu < TUN_MTU_MIN) {
+        errorf("invalid mtu, dev=%s, mtu=%u", dev->name, mtu);
+        return -1;
+    }
+    /* NOTE: set on the host interface at open, otherwise the MTU of the host interface is used */
+    PRIV(dev)->mtu = mtu;
+    debugf("dev=%s, mtu=%u", dev->name, mtu);
+    return 0;
+}
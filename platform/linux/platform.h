@@ -50,6 +50,32 @@ mutex_unlock(mutex_t *mutex)
     return pthread_mutex_unlock(mutex);
 }
 
+/*
+ * Thread
+ */
+
+typedef pthread_t thread_t;
+
+/* NOTE: the signals are handled by the interrupt thread, the new thread blocks all of them */
+static inline int
+thread_create(thread_t *thread, void *(*func)(void *arg), void *arg)
+{
+    sigset_t all, old;
+    int ret;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(thread, NULL, func, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return ret;
+}
+
+static inline int
+thread_join(thread_t thread)
+{
+    return pthread_join(thread, NULL);
+}
+
 /*
  * Scheduler
  */
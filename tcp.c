@@ -19,6 +19,12 @@
 #define TCP_FLG_ACK 0x10
 #define TCP_FLG_URG 0x20
 
+#define TCP_OPT_EOL 0x00
+#define TCP_OPT_NOP 0x01
+#define TCP_OPT_MSS 0x02
+
+#define TCP_DEFAULT_MSS 536 /* assumed without the MSS option (RFC1122) */
+
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
@@ -73,6 +79,7 @@ struct tcp_segment_info {
     uint16_t len;
     uint16_t wnd;
     uint16_t up;
+    uint16_t mss; /* MSS option of the SYN (0: none) */
 };
 
 struct tcp_pcb {
@@ -96,13 +103,14 @@ struct tcp_pcb {
     } rcv;
     uint32_t irs;
     uint16_t mtu;
-    uint16_t mss;
+    uint16_t mss; /* the largest segment to send, MIN(peer's MSS, our MTU - 40) */
     uint8_t buf[65535]; /* receive buffer */
     struct sched_ctx ctx;
     struct queue_head queue; /* retransmit queue */
     struct timeval tw_timer;
     struct tcp_pcb *parent;
     struct queue_head backlog;
+    struct ip_dst dst; /* route and next hop to the foreign address */
 };
 
 struct tcp_queue_entry {
@@ -118,7 +126,7 @@ static mutex_t mutex = MUTEX_INITIALIZER;
 static struct tcp_pcb pcbs[TCP_PCB_SIZE];
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+tcp_output_segment(struct ip_dst *cache, uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
@@ -313,7 +321,7 @@ tcp_retransmit_queue_emit(void *arg, void *data)
     timeout = entry->last;
     timeval_add_usec(&timeout, entry->rto);
     if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
+        tcp_output_segment(&pcb->dst, entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
         entry->last = now;
         entry->rto *= 2;
     }
@@ -328,39 +336,60 @@ tcp_set_timewait_timer(struct tcp_pcb *pcb)
 }
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_output_segment(struct ip_dst *cache, uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
+    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t psum;
     uint16_t total;
+    struct ip_iface *iface;
+    uint8_t *opt;
+    size_t optlen = 0;
+    uint16_t mss;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
+    /* NOTE: cache is NULL for the segments without a connection (e.g. RST) */
+    iface = ip_dst_get_iface(cache, foreign->addr);
     hdr = (struct tcp_hdr *)buf;
+    opt = (uint8_t *)(hdr + 1);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN) && iface) {
+        /* NOTE: without the MSS option the peer assumes 536 bytes, let it fill our MTU (e.g. jumbo frames) */
+        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(*hdr));
+        opt[optlen++] = TCP_OPT_MSS;
+        opt[optlen++] = 4;
+        opt[optlen++] = mss >> 8;
+        opt[optlen++] = mss & 0xff;
+    }
     hdr->src = local->port;
     hdr->dst = foreign->port;
     hdr->seq = hton32(seq);
     hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4;
+    hdr->off = ((sizeof(*hdr) + optlen) >> 2) << 4;
     hdr->flg = flg;
     hdr->wnd = hton16(wnd);
     hdr->sum = 0;
     hdr->up = 0;
-    memcpy(hdr + 1, data, len);
+    memcpy(opt + optlen, data, len);
     pseudo.src = local->addr;
     pseudo.dst = foreign->addr;
     pseudo.zero = 0;
     pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
+    total = sizeof(*hdr) + optlen + len;
     pseudo.len = hton16(total);
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    if (iface && NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_CSUM_TX) {
+        hdr->sum = psum; /* partial checksum, completed by the device */
+    } else if (iface && IP_HDR_SIZE_MIN + total > NET_IFACE(iface)->dev->mtu) {
+        hdr->sum = psum; /* NOTE: summed per piece by ip_output_gso(), not twice */
+    } else {
+        hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    }
     debugf("%s => %s, len=%u (payload=%zu)",
         ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
     tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
+    if (ip_output_dst(cache, IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
         return -1;
     }
     return len;
@@ -378,7 +407,7 @@ tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
     if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
         tcp_retransmit_queue_add(pcb, seq, flg, data, len);
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    return tcp_output_segment(&pcb->dst, seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
 }
 
 /* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
@@ -394,9 +423,9 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             return;
         }
         if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+            tcp_output_segment(NULL, 0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(NULL, seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
         }
         return;
     }
@@ -412,7 +441,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * second check for an ACK
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(NULL, seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
             return;
         }
         /*
@@ -436,6 +465,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             pcb->rcv.wnd = sizeof(pcb->buf);
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            pcb->mss = seg->mss ? seg->mss : TCP_DEFAULT_MSS;
             pcb->iss = random();
             tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
             pcb->snd.nxt = pcb->iss + 1;
@@ -456,7 +486,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
             if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+                tcp_output_segment(NULL, seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
                 return;
             }
             if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
@@ -484,6 +514,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            pcb->mss = seg->mss ? seg->mss : TCP_DEFAULT_MSS;
             if (acceptable) {
                 pcb->snd.una = seg->ack;
                 tcp_retransmit_queue_cleanup(pcb);
@@ -634,7 +665,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 sched_wakeup(&pcb->parent->ctx);
             }
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(NULL, seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
             return;
         }
         /* fall through */
@@ -646,6 +677,8 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         if (pcb->snd.una < seg->ack && seg->ack <= pcb->snd.nxt) {
             pcb->snd.una = seg->ack;
             tcp_retransmit_queue_cleanup(pcb);
+            /* NOTE: new data acknowledged, the neighbor is reachable (no ARP refresh needed) */
+            ip_dst_confirm(&pcb->dst);
             /* ignore: Users should receive positive acknowledgments for buffers
                         which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
             if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack)) {
@@ -768,8 +801,33 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     return;
 }
 
+/* NOTE: the options are sent only with SYN, 0 when the MSS option is not found (or malformed) */
+static uint16_t
+tcp_option_mss(const uint8_t *opt, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+        if (opt[i] == TCP_OPT_EOL) {
+            break;
+        }
+        if (opt[i] == TCP_OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len || opt[i+1] < 2 || i + opt[i+1] > len) {
+            break;
+        }
+        if (opt[i] == TCP_OPT_MSS && opt[i+1] == 4) {
+            return (opt[i+2] << 8) | opt[i+3];
+        }
+        i += opt[i+1];
+    }
+    return 0;
+}
+
 static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
 {
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
@@ -784,15 +842,17 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         return;
     }
     hdr = (struct tcp_hdr *)data;
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    if (!(flags & NET_INPUT_FLAG_CSUM_VALID)) {
+        pseudo.src = src;
+        pseudo.dst = dst;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_TCP;
+        pseudo.len = hton16(len);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+            errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+            return;
+        }
     }
     if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
         errorf("only supports unicast, src=%s, dst=%s",
@@ -809,6 +869,10 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     foreign.addr = src;
     foreign.port = hdr->src;
     hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("invalid header length, hlen=%u, len=%zu", hlen, len);
+        return;
+    }
     seg.seq = ntoh32(hdr->seq);
     seg.ack = ntoh32(hdr->ack);
     seg.len = len - hlen;
@@ -820,6 +884,10 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     }
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
+    seg.mss = 0;
+    if (TCP_FLG_ISSET(hdr->flg, TCP_FLG_SYN)) {
+        seg.mss = tcp_option_mss((uint8_t *)(hdr + 1), hlen - sizeof(*hdr));
+    }
     mutex_lock(&mutex);
     tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
     mutex_unlock(&mutex);
@@ -1234,13 +1302,20 @@ RETRY:
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
+        iface = ip_dst_get_iface(&pcb->dst, pcb->foreign.addr);
         if (!iface) {
             errorf("iface not found");
             mutex_unlock(&mutex);
             return -1;
         }
         mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+        if (pcb->mss < mss) {
+            /* NOTE: the pieces of TSO/GSO are cut at our MTU, too large for the peer */
+            mss = pcb->mss;
+        } else {
+            /* NOTE: one large segment, cut into MTU-sized ones by the device (TSO) or just above it (GSO) */
+            mss = NET_DEVICE_GSO_SIZE(NET_IFACE(iface)->dev) - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+        }
         while (sent < (ssize_t)len) {
             cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
             if (!cap) {
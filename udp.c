@@ -147,7 +147,7 @@ udp_pcb_id(struct udp_pcb *pcb)
 }
 
 static void
-udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface, int flags)
 {
     struct pseudo_hdr pseudo;
     uint16_t psum = 0;
@@ -166,15 +166,17 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         errorf("length error: len=%zu, hdr->len=%u", len, ntoh16(hdr->len));
         return;
     }
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_UDP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    if (!(flags & NET_INPUT_FLAG_CSUM_VALID)) {
+        pseudo.src = src;
+        pseudo.dst = dst;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_UDP;
+        pseudo.len = hton16(len);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+            errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+            return;
+        }
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
@@ -207,13 +209,15 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     mutex_unlock(&mutex);
 }
 
-ssize_t
-udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+/* NOTE: cache is the route resolved by the caller (NULL: looked up here) */
+static ssize_t
+udp_output_dst(struct ip_dst *cache, struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len)
 {
     uint8_t buf[IP_PAYLOAD_SIZE_MAX];
     struct udp_hdr *hdr;
     struct pseudo_hdr pseudo;
     uint16_t total, psum = 0;
+    struct ip_iface *iface;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
@@ -234,17 +238,28 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *dat
     pseudo.protocol = IP_PROTOCOL_UDP;
     pseudo.len = hton16(total);
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    iface = ip_dst_get_iface(cache, dst->addr);
+    if (iface && NET_IFACE(iface)->dev->features & NET_DEVICE_FEATURE_CSUM_TX) {
+        hdr->sum = psum; /* partial checksum, completed by the device */
+    } else {
+        hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    }
     debugf("%s => %s, len=%u (payload=%zu)",
         ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
     udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
-        errorf("ip_output() failure");
+    if (ip_output_dst(cache, IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
+        errorf("ip_output_dst() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+{
+    return udp_output_dst(NULL, src, dst, data, len);
+}
+
 static void
 event_handler(void *arg)
 {
@@ -341,6 +356,7 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
 {
     struct udp_pcb *pcb;
     struct ip_endpoint local;
+    struct ip_dst dst = {};
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     uint32_t p;
@@ -352,15 +368,16 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
+    /* NOTE: resolved once for the datagram, used for the source address, the checksum offload and the output */
+    iface = ip_dst_get_iface(&dst, foreign->addr);
+    if (!iface) {
+        errorf("iface not found that can reach foreign address, addr=%s",
+            ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+        mutex_unlock(&mutex);
+        return -1;
+    }
     local.addr = pcb->local.addr;
     if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
-        if (!iface) {
-            errorf("iface not found that can reach foreign address, addr=%s",
-                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
-            return -1;
-        }
         local.addr = iface->unicast;
         debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
     }
@@ -380,7 +397,7 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
     }
     local.port = pcb->local.port;
     mutex_unlock(&mutex);
-    return udp_output(&local, foreign, data, len);
+    return udp_output_dst(&dst, &local, foreign, data, len);
 }
 
 ssize_t
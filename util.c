@@ -232,3 +232,30 @@ cksum16(uint16_t *addr, uint16_t count, uint32_t init)
     }
     return ~(uint16_t)sum;
 }
+
+size_t
+iovec_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/* NOTE: copy at most size bytes from the head (e.g. to peek the headers) */
+size_t
+iovec_gather(uint8_t *buf, size_t size, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0, n;
+    int i;
+
+    for (i = 0; i < iovcnt && len < size; i++) {
+        n = MIN(iov[i].iov_len, size - len);
+        memcpy(buf + len, iov[i].iov_base, n);
+        len += n;
+    }
+    return len;
+}
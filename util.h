@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #ifndef MAX
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
@@ -83,4 +84,9 @@ ntoh32(uint32_t n);
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
 
+extern size_t
+iovec_len(const struct iovec *iov, int iovcnt);
+extern size_t
+iovec_gather(uint8_t *buf, size_t size, const struct iovec *iov, int iovcnt);
+
 #endif